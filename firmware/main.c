@@ -22,8 +22,10 @@
 
 #include <string.h>
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
 
@@ -128,6 +130,380 @@
 /* ---- End calibration values -------------------------------------------- */
 
 
+/* ---- Optional features ------------------------------------------------- */
+
+/**
+  Features which don't fit into the ATtiny2313 all at once, so they're off
+  by default. Some of them change the USB configuration as well, so enable
+  them with FEATURES in the Makefile rather than here.
+*/
+
+/** \def SERIAL_NUMBER
+
+  Report a per-unit serial number, stored in EEPROM, as USB string
+  descriptor. This way hosts can tell identical units apart without talking
+  to each of them, e.g. by udev rules. The serial number is written with the
+  'S' request, see "istatrol-tool serial". Until then it's empty.
+
+  SERIAL_NUMBER_LEN is the number of characters stored.
+*/
+#ifdef SERIAL_NUMBER
+  #define SERIAL_NUMBER_LEN 8
+#endif
+
+/** \def HEALTH
+
+  Keep counters about how well the firmware is doing and send them with
+  the 'h' request, see struct health below and "istatrol-tool health".
+  Needs the tick, so it occupies the Timer 0 compare A interrupt.
+*/
+
+/** \def HISTOGRAM
+
+  Diagnostic mode for measurement noise. Request 'N' stops regulating and
+  measures TEMP_C as fast as discharging the capacitor allows, binning raw
+  Timer 1 captures, no smoothing, into struct histogram. Request 'n'
+  fetches it, see "istatrol-tool histogram".
+
+  HISTOGRAM_BINS is the number of bins, HISTOGRAM_POLLS the number of 20 ms
+  usbPoll() steps per capture: about 10 ms loading, the rest discharging.
+  At least TEMP_TIMEOUT_MS, so a missing sensor shows up as a timeout.
+*/
+#ifdef HISTOGRAM
+  #define HISTOGRAM_BINS 16
+  #define HISTOGRAM_POLLS (TEMP_TIMEOUT_MS / 20 + 1)
+#endif
+
+/** \def SOF_SYNC
+
+  Start each measurement at a fixed time after a USB start of frame (SOF,
+  on low speed the keep-alive every millisecond), chosen so that the
+  comparator is expected to trigger SOF_EDGE_PHASE after a SOF. V-USB's
+  interrupt runs at the start of a frame and for all traffic, which hosts
+  tend to schedule early in the frame. A comparator interrupt delayed by a
+  received packet captures Timer 1 up to some 100 counts late, this keeps
+  such collisions rare. Check the effect with HISTOGRAM, with less noise
+  THERMISTOR_HYSTERESIS can be smaller.
+
+  Unit of SOF_EDGE_PHASE is Timer 1 counts, SOF_FRAME_COUNTS per frame.
+*/
+#ifdef SOF_SYNC
+  #define SOF_FRAME_COUNTS (F_CPU / 8 / 1000)
+  #define SOF_EDGE_PHASE (SOF_FRAME_COUNTS * 3 / 4)
+#endif
+
+/** \def ADAPTIVE_DISCHARGE
+
+  Instead of one measurement per channel and second, measure again as
+  soon as the capacitor is discharged enough and report the average of
+  all measurements in that second. Discharging goes through the same
+  thermistor as charging, so the time needed follows from the last
+  reading. Hot sensors give short readings and many measurements.
+
+  Charging from 0 V to the 1.06 V reference at 5 V takes 0.24 RC.
+  Discharging from there to a residual which shortens the next reading by
+  less than 1/1024 takes 6.8 RC, so DISCHARGE_RATIO times as long.
+  DISCHARGE_STEP_MS is the resolution of this timing.
+*/
+#ifdef ADAPTIVE_DISCHARGE
+  #define DISCHARGE_RATIO 29
+  #define DISCHARGE_STEP_MS 4
+  #define DISCHARGE_STEPS (1000 / DISCHARGE_STEP_MS)
+  // Readout counts per step of discharging.
+  #define DISCHARGE_DIVISOR \
+    (F_CPU / 8 / 1000 * DISCHARGE_STEP_MS / DISCHARGE_RATIO)
+#endif
+
+/** \def REFERENCE_RESISTOR
+
+  Measure a precision resistor on TEMP_REF like a thermistor, once per
+  round, and report all readings relative to it. This cancels tolerance and
+  drift of the capacitor, of the comparator threshold and of the clock, so
+  calibration stays valid over time and across boards. Readings are scaled
+  to REFERENCE_NOMINAL, the reference's reading on the calibration board,
+  to keep the unit and the calibration values above. Each round takes one
+  poll_a_second() longer.
+
+  With 12.7 kOhms, 0.1%, readings are about 450 per kOhm.
+*/
+#ifdef REFERENCE_RESISTOR
+  #define REFERENCE_NOMINAL 5715
+#endif
+
+/** \def BANDGAP_REFERENCE
+
+  Compare against the internal bandgap reference (ACBG) instead of the
+  divider on AIN1. No divider drift, and it frees a pin. Needs the
+  capacitor moved from AIN0 (PB0) to AIN1 (PB1), the divider removed.
+
+  The bandgap is 1.0 to 1.2 V, depending on the chip, so readings need
+  calibration: with a known resistor in place of TEMP_C (or the sensor at
+  a known temperature), "istatrol-tool bandgap READING" tells the reading
+  the calibration board gave for it. It's stored in EEPROM, readings are
+  scaled accordingly from then on. With REFERENCE_RESISTOR, readings are
+  relative to the reference anyways, so no calibration there.
+
+  Compare noise with HISTOGRAM and drift with logs of istatrold against
+  the divider before relying on it.
+*/
+#if defined BANDGAP_REFERENCE && ! defined REFERENCE_RESISTOR
+  #define BANDGAP_CALIBRATION
+#endif
+
+/** \def SLEEP
+
+  Sleep instead of busy waiting. Between events, the CPU idles until the
+  tick, USB or the comparator wakes it.
+
+  Without a start of frame for SUSPEND_MS, the bus is suspended, or there
+  is no host at all, e.g. with an external supply. Waits between
+  measurements then use power-down mode, with the watchdog interrupt as a
+  slow tick every WDT_TICK_MS. Measuring and regulating carry on. Timer 0
+  stops and so does its tick, so ticks get advanced on each watchdog
+  wakeup instead. D- going low, which is what resume and reset look like,
+  wakes the CPU as well and returns to idle sleep.
+
+  Needs the tick and counts SOFs, see USB_COUNT_SOF in usbconfig.h.
+*/
+#ifdef SLEEP
+  #define SUSPEND_MS 3
+  #define WDT_TICK_MS 16
+#endif
+
+/** \def OSCCAL_CACHE
+
+  Start with the OSCCAL value which worked last time, stored in EEPROM,
+  instead of the factory value, which osctune.h takes a while to tune
+  from. It gets stored once per power-up after enumeration, and only if
+  it differs from the stored value by more than OSCCAL_SLACK, to limit
+  EEPROM wear. Without a plausible stored value, OSCCAL gets searched for
+  at the first USB reset, like osccal.c does.
+
+  Also skips the USB disconnect after a power-on reset, the host can't
+  know about us at that point. "istatrol-tool health" shows the time to
+  enumeration, with HEALTH.
+*/
+#ifdef OSCCAL_CACHE
+  #define OSCCAL_SLACK 2
+#endif
+
+/** \def BUTTONS
+
+  Local control with the PLUS and MINUS buttons, no host needed. A short
+  press moves the target by BUTTON_STEP, PLUS towards warmer. Holding a
+  button for BUTTON_HOLD_MS moves the valve once, PLUS opening it, and
+  regulation then waits a full RADIATOR_RESPONSE_TIME before acting again.
+  Each of these gets recorded for the host, see struct buttons and
+  "istatrol-tool buttons".
+
+  Pin change interrupts exist on port B only, the buttons are on port A.
+  So the tick samples them, a change counts after BUTTON_DEBOUNCE_MS of
+  equal samples. Nothing of this runs in the main loop.
+
+  Board change needed: PLUS (PA1) and MINUS (PA0) connect to Vcc when
+  pressed and float when released. Add a pulldown of about 100 kOhm from
+  each of them to GND, else released buttons read randomly.
+*/
+#ifdef BUTTONS
+  #define BUTTON_STEP        100
+  #define BUTTON_HOLD_MS     1000
+  #define BUTTON_DEBOUNCE_MS 20
+  #define BUTTON_EVENTS      4
+#endif
+
+/** \def LEDS
+
+  Show what's going on with the two LEDs, so a unit can be checked without
+  a laptop. Both run patterns of 8 slots, LED_SLOT_MS each, driven by the
+  tick. The main loop doesn't do anything for this.
+
+  LED_G (LED1) is about USB:
+
+    fast blink            not configured (yet)
+    on                    configured by the host
+    short flash           bus suspended or no host (SLEEP only)
+
+  LED_Y (LED2) is about regulation, in this order of precedence:
+
+    fast blink            valve moving
+    slow blink            sensor fault, valve held
+    on                    last decision found the target reached
+    off                   otherwise
+
+  A measurement inverts LED_Y for one slot. While suspended, LED_Y flashes
+  shortly on a sensor fault and stays off otherwise, saving current.
+*/
+#ifdef LEDS
+  #define LED_SLOT_MS 128
+#endif
+
+/** \def WATCHDOG
+
+  Reset by the watchdog if USB polling, measuring or regulating stops
+  making progress, so a hung unit doesn't leave the valve wherever it was
+  for good. The watchdog gets fed only after all three did something since
+  the last feeding, see watchdog_done(). WATCHDOG_PERIOD must cover the
+  longest main loop round: measuring all sensors, about a second each,
+  plus a valve movement, plus one by a button.
+
+  What caused the last reset, and with a watchdog reset which of the three
+  stalled, survives the reset in .noinit RAM. The 'r' request reports it,
+  see struct watchdog and "istatrol-tool resets".
+
+  With SLEEP, waking from power-down needs the watchdog, which feeds it.
+  Power-down is then used only as long as the last real feeding is less
+  than WATCHDOG_MS ago.
+*/
+#ifdef WATCHDOG
+  #define WATCHDOG_PERIOD WDTO_8S
+  #define WATCHDOG_MS     8000
+#endif
+
+/** \def ADAPTIVE_HYSTERESIS
+
+  Instead of the fixed THERMISTOR_HYSTERESIS, use HYSTERESIS_FACTOR times
+  the standard deviation of TEMP_C readings, limited to HYSTERESIS_MIN..
+  HYSTERESIS_MAX. Quiet installations get a tighter band, noisy ones a
+  wider one, without the valve moving more often. The estimate starts out
+  at THERMISTOR_HYSTERESIS and forgets with a time constant of about
+  2^NOISE_SHIFT readings, see struct noise.
+
+  Regulation looks at smoothed readings, extrapolated, see
+  PREDICTION_STEEPNESS. Noise of that is about 1.6 times the noise of
+  single readings, so a factor of 4 keeps the valve still with about
+  2.5 sigma.
+*/
+#ifdef ADAPTIVE_HYSTERESIS
+  #define HYSTERESIS_FACTOR 4
+  #define HYSTERESIS_MIN    10
+  #define HYSTERESIS_MAX    200
+  #define NOISE_SHIFT       6
+  #define NOISE_CLAMP       2047
+#endif
+
+/** \def CASCADE
+
+  Cascade control. TEMP_V on the valve body sees valve movements much
+  sooner than TEMP_C on the ISTA counter. With this, regulation on TEMP_C,
+  see main(), no longer moves the valve. It moves a target for TEMP_V by
+  CASCADE_STEP instead. An inner loop moves the valve to keep TEMP_V
+  within CASCADE_HYSTERESIS of this target, acting every
+  CASCADE_RESPONSE_TIME loop rounds.
+
+  The TEMP_V target stays within CASCADE_WINDUP of the actual TEMP_V
+  reading, so it can't run away while the valve sits at one of its ends.
+
+  Measuring TEMP_V as well makes a loop round about two seconds. Note that
+  RADIATOR_RESPONSE_TIME counts loop rounds.
+*/
+#ifdef CASCADE
+  #define CASCADE_STEP          100
+  #define CASCADE_HYSTERESIS    50
+  #define CASCADE_RESPONSE_TIME 15
+  #define CASCADE_WINDUP        400
+#endif
+
+/** \def ROOM_CONTROL
+
+  Regulate the room, TEMP_R, to ROOM_TARGET with the radiator, as seen by
+  TEMP_C, as cool as possible. ISTA counters bill on radiator temperature,
+  so this is what saves money. The TEMP_C target is no longer fixed, every
+  ROOM_RESPONSE_TIME loop rounds it gets moved:
+
+    room too cold         radiator warmer by ROOM_STEP
+    room too warm         radiator cooler by ROOM_STEP
+    room within band      radiator cooler by ROOM_DRIFT
+
+  The band is ROOM_HYSTERESIS around ROOM_TARGET. With the room within the
+  band, the radiator creeps down until the room leaves it, then steps up
+  again. The TEMP_C target stays within ROOM_C_MIN..ROOM_C_MAX. With a
+  faulty room sensor, it's kept as is.
+
+  To compare settings, the sum of TEMP_R - TEMP_C over loop rounds, what
+  ISTA counters bill on, gets reported with the 'u' request, see
+  struct room and "istatrol-tool room". With BUTTONS, buttons adjust
+  ROOM_TARGET instead of TARGET_TEMPERATURE.
+
+  Units are thermistor readouts, ROOM_TARGET 6500 is about 20 degrees
+  Celsius with the calibration in host/protocol.h.
+*/
+#ifdef ROOM_CONTROL
+  #define ROOM_TARGET        6500
+  #define ROOM_HYSTERESIS    60
+  #define ROOM_RESPONSE_TIME 300
+  #define ROOM_STEP          200
+  #define ROOM_DRIFT         25
+  #define ROOM_C_MIN         2000
+  #define ROOM_C_MAX         8000
+#endif
+
+/** \def SHADOW
+
+  Run a candidate regulation next to the active one, to compare the two
+  on the same radiator and the same weather. The candidate sees the same
+  readings, target and moments of decision, but its decisions only get
+  counted, never actuated. It's the predictive regulation in main() with
+  SHADOW_STEEPNESS instead of PREDICTION_STEEPNESS and SHADOW_HYSTERESIS
+  instead of the active hysteresis. SHADOW_STEEPNESS 0 is a plain
+  Bang-Bang regulator.
+
+  Counts of agreeing and disagreeing decisions are reported with the 'x'
+  request, see struct shadow and "istatrol-tool shadow".
+*/
+#ifdef SHADOW
+  #define SHADOW_STEEPNESS  0
+  #define SHADOW_HYSTERESIS THERMISTOR_HYSTERESIS
+#endif
+
+/** \def EMERGENCY
+
+  A wider band around the target, EMERGENCY_HYSTERESIS. If the thermistor
+  readout leaves it, e.g. because a window got opened, regulation acts
+  right away instead of waiting for RADIATOR_RESPONSE_TIME, but only once
+  per excursion and not before EMERGENCY_RESPONSE_TIME since the last
+  action. After that, RADIATOR_RESPONSE_TIME applies again until the
+  readout is back in the band, as a valve movement takes minutes to show.
+  This decision looks at the readout as is, without extrapolation, as a
+  trend over a few rounds doesn't fit PREDICTION_STEEPNESS. Deviations
+  within the band are left to regular regulation.
+
+  EMERGENCY_HYSTERESIS is in readout units, THERMISTOR_HYSTERESIS..16000,
+  EMERGENCY_RESPONSE_TIME in seconds (approximately), less than
+  RADIATOR_RESPONSE_TIME.
+*/
+#ifdef EMERGENCY
+  #define EMERGENCY_HYSTERESIS    400
+  #define EMERGENCY_RESPONSE_TIME 15
+#endif
+
+/**
+  EEPROM layout. Addresses are fixed, so stored values survive firmware
+  updates with a different set of features.
+*/
+#define EEPROM_SERIAL_NUMBER ((uint8_t *)0)  // SERIAL_NUMBER_LEN bytes.
+#define EEPROM_BANDGAP       ((void *)8)     // struct bandgap, 4 bytes.
+#define EEPROM_OSCCAL        ((uint8_t *)12) // OSCCAL and ~OSCCAL.
+
+/**
+  Whether usbFunctionSetup() has to look at the request at all.
+*/
+#if defined CAN_AFFORD_USB_COMMANDS || defined SERIAL_NUMBER || \
+    defined HEALTH || defined HISTOGRAM || defined BANDGAP_CALIBRATION || \
+    defined BUTTONS || defined WATCHDOG || defined ROOM_CONTROL || \
+    defined SHADOW
+  #define HAVE_USB_REQUESTS
+#endif
+
+/**
+  Whether the millisecond tick is needed.
+*/
+#if defined HEALTH || defined SLEEP || defined BUTTONS || defined LEDS
+  #define HAVE_TICK
+#endif
+
+/* ---- End optional features --------------------------------------------- */
+
+
 /**
   Using continuous calibration is much smaller (36 bytes, in osctune.h, vs.
   194 bytes for reset-time calibration, osccal.c) and ensures working USB for
@@ -135,6 +511,63 @@
 */
 uint8_t lastTimer0Value; // See osctune.h.
 
+#ifdef HAVE_TICK
+/**
+  Milliseconds since power-up, wrapping. Counted by the Timer 0 compare A
+  interrupt, see tick_init(), after hardware_init() accounted for the USB
+  disconnect.
+*/
+static volatile uint16_t ticks = 0;
+#endif
+
+#ifdef SLEEP
+/**
+  Whether the bus looks suspended, see SLEEP. Maintained by the tick.
+*/
+static volatile uint8_t usb_suspended = 0;
+#endif
+
+#ifdef HEALTH
+/**
+  Health counters, sent as is with the 'h' request. Counters saturate
+  rather than wrap, except uptime.
+
+  Updated from interrupts as well, so a reply may rarely catch a multi-byte
+  value half way through an update. Good enough for statistics.
+*/
+static struct {
+  uint16_t usb_resets;      // USB resets seen by usbPoll().
+  uint16_t retriggers;      // Measurements with triggers after capture.
+  uint16_t timeouts;        // Measurements without a reading.
+  uint16_t usbpoll_max;     // Longest interval between usbPoll(), ms.
+  uint8_t osccal;           // OSCCAL at the time of the request.
+  uint8_t osccal_min;       // Lowest OSCCAL seen since power-up.
+  uint8_t osccal_max;       // Highest OSCCAL seen since power-up.
+  uint32_t uptime;          // Seconds since power-up.
+  uint16_t enumerated;      // Milliseconds from reset to configured.
+} health = { .osccal_min = 0xFF };
+#endif
+
+#ifdef HISTOGRAM
+/**
+  Histogram of raw captures, sent as is with the 'n' request. Bin i counts
+  captures from low + i * 2^shift up to just below the next bin. Counting
+  stops as soon as one counter reaches 255, so the shape stays true.
+*/
+#define HISTOGRAM_OFF      0
+#define HISTOGRAM_RUNNING  1
+#define HISTOGRAM_FULL     2
+
+static struct {
+  uint8_t state;            // HISTOGRAM_OFF, _RUNNING or _FULL.
+  uint8_t shift;            // Bin width is 2^shift.
+  uint16_t low;             // Lower end of bin 0, 0 = take the first capture.
+  uint8_t below;            // Captures below bin 0.
+  uint8_t above;            // Captures above the last bin.
+  uint8_t bins[HISTOGRAM_BINS];
+} histogram;
+#endif
+
 /**
   We don't need to store much status because we don't implement multiple chunks
   in read/write transfers.
@@ -152,26 +585,127 @@ static union {
   Values: ' '  no motor movement
           '+'  valve opened
           '-'  valve closed
+          '!'  sensor fault, valve held, see TEMP_FAULT
 */
 //uint8_t motor_moved = ' '; // See struct answer below.
 
+/**
+  Special readings. TEMP_FAULT means the comparator didn't trigger within
+  TEMP_TIMEOUT Timer 1 overflows (41 ms each), e.g. because a sensor is
+  missing. TEMP_FAULT is also what's sent over USB then. Captures count
+  these overflows, so they resolve up to the timeout; readings, what's
+  left after averaging, are limited to TEMP_MAX, as they're 16 bits wide.
+*/
+#define TEMP_MAX     0xFFFE
+#define TEMP_FAULT   0xFFFF
+#define TEMP_TIMEOUT 2
+#define TEMP_TIMEOUT_MS (TEMP_TIMEOUT * 65536L * 8 * 1000 / F_CPU + 1)
+
 /**
   Our last temperature measurements.
 */
-static uint16_t temp_c = 0; // Reading used for controlling.
-#ifdef MULTISENSOR_BROKEN
-static uint16_t temp_v = 0;
-static uint16_t temp_r = 0;
+static uint16_t temp_c = TEMP_FAULT; // Reading used for controlling.
+#if defined MULTISENSOR_BROKEN || defined CASCADE
+static uint16_t temp_v = TEMP_FAULT;
+#endif
+#if defined MULTISENSOR_BROKEN || defined ROOM_CONTROL
+static uint16_t temp_r = TEMP_FAULT;
+#endif
+#ifdef CASCADE
+static uint32_t temp_v_eight;
+#endif
+#ifdef ROOM_CONTROL
+static uint32_t temp_r_eight;
 #endif
 static uint16_t temp_temp = 0; // Reading directly from ADC.
-#if TARGET_TEMPERATURE < 7000
-  // We can expect thermistor readings to be always below 8192, so it always
-  // fits into 12 bits and we can always keep a multiplication by 8.
-  // Initialize to a reasonable value to avoid underflows on the first steps.
-  static uint16_t temp_temp_eight = TARGET_TEMPERATURE * 8L;
+// Eight times temp_c for smoothing, 32 bits to fit any reading.
+static uint32_t temp_temp_eight;
+#ifdef REFERENCE_RESISTOR
+static uint16_t temp_ref = TEMP_FAULT;
+static uint32_t temp_ref_eight;
+#endif
+
+#ifdef BANDGAP_CALIBRATION
+/**
+  Bandgap calibration, readings get scaled by nominal / measured. Stored in
+  EEPROM and sent as is with the 'B' request.
+*/
+static struct {
+  uint16_t nominal;         // Reading of the calibration board.
+  uint16_t measured;        // Reading here, same resistance.
+} bandgap;
 #endif
 
 static uint8_t conversion_done = 0;
+static uint8_t temp_overflows = 0; // Timer 1 overflows this measurement.
+static uint32_t temp_capture;      // Timer 1 count, overflows included.
+
+/**
+  Bit in GPIOR0 set by ISR(TIMER1_OVF_vect) with interrupts still disabled,
+  telling about an overflow not yet in temp_overflows.
+*/
+#define TEMP_OVERFLOWED 0
+
+#ifdef BUTTONS
+/**
+  Button events and the target they led to, sent as is with the 'e'
+  request. Event number count - 1 is in event[(count - 1) % BUTTON_EVENTS],
+  the ones before it precede it. Events:
+
+    '+'  PLUS pressed, target lowered by BUTTON_STEP (warmer)
+    '-'  MINUS pressed, target raised by BUTTON_STEP (colder)
+    'o'  PLUS held, valve opened
+    'c'  MINUS held, valve closed
+
+  All written by the tick, so reading target from the main loop needs
+  locking.
+*/
+static volatile struct {
+  uint8_t count;            // Events since power-up, wrapping.
+  uint8_t pressed;          // Buttons down, debounced, bits as on PINA.
+  uint16_t target;          // TARGET_TEMPERATURE or ROOM_TARGET, adjusted.
+  uint8_t event[BUTTON_EVENTS];
+#ifdef ROOM_CONTROL
+} buttons = { .target = ROOM_TARGET };
+#else
+} buttons = { .target = TARGET_TEMPERATURE };
+#endif
+
+/**
+  Valve movement asked for by holding a button, 'o' or 'c', 0 for none.
+*/
+static volatile uint8_t buttons_move = 0;
+#endif
+
+#ifdef ROOM_CONTROL
+/**
+  State of ROOM_CONTROL, sent as is with the 'u' request. units and rounds
+  wrap, take differences between two requests.
+*/
+static struct {
+  uint16_t target;          // TEMP_C target, as set by room control.
+  uint16_t temp_r;          // TEMP_R at the time of the request.
+  uint32_t units;           // Sum of TEMP_R - TEMP_C, where positive.
+  uint32_t rounds;          // Loop rounds summed up in units.
+} room = { .target = TARGET_TEMPERATURE };
+#endif
+
+#ifdef SHADOW
+/**
+  Decisions of the active and the SHADOW regulation, sent as is with the
+  'x' request. Decisions are '+' for opening, '-' for closing and ' ' for
+  holding the valve. Counters wrap, take differences between two requests.
+*/
+static struct {
+  uint16_t decisions;       // Decisions taken by both.
+  uint16_t agreed;          // Decisions both took the same.
+  uint16_t opposed;         // One opening, the other one closing.
+  uint16_t active_moves;    // Decisions to move by the active one.
+  uint16_t shadow_moves;    // Decisions to move by the candidate.
+  char active;              // Last decision of the active one.
+  char shadow;              // Last decision of the candidate.
+} shadow = { .active = ' ', .shadow = ' ' };
+#endif
 
 #ifndef CAN_AFFORD_USB_COMMANDS
 /**
@@ -184,6 +718,11 @@ static uint8_t conversion_done = 0;
 static struct {
   uint16_t temp_last;
   uint8_t motor_moved;
+#ifdef MULTISENSOR_BROKEN
+  uint16_t temp_v;
+  uint16_t temp_r;
+#endif
+  uint8_t decisions;        // Counts control decisions, wrapping.
 } answer;
 #endif
 
@@ -232,8 +771,731 @@ static void motor_close(void) {
   WRITE(MOT_CLOSE, 0);
 }
 
+/* ---- Buttons ----------------------------------------------------------- */
+
+#ifdef BUTTONS
+#define PRESSED_PLUS  MASK(BUTTON_PLUS_PIN)
+#define PRESSED_MINUS MASK(BUTTON_MINUS_PIN)
+
+/**
+  Which buttons are down, not debounced. The pins stay inputs without
+  pullup, as after reset. Buttons connect them straight to Vcc, so they
+  must never be driven, see BUTTONS for the pulldowns this needs.
+*/
+static inline uint8_t buttons_read(void) {
+
+  return BUTTON_PLUS_RPORT & (PRESSED_PLUS | PRESSED_MINUS);
+}
+
+/**
+  Record an event, plus if just PLUS is down, minus if just MINUS is.
+*/
+static void buttons_event(uint8_t pressed, uint8_t plus, uint8_t minus) {
+  uint8_t event;
+
+  if (pressed == PRESSED_PLUS)
+    event = plus;
+  else if (pressed == PRESSED_MINUS)
+    event = minus;
+  else
+    return;
+
+  buttons.event[buttons.count % BUTTON_EVENTS] = event;
+  buttons.count++;
+}
+
+/**
+  Debounce and act, see BUTTONS. Called by the tick, ms milliseconds after
+  the previous call.
+
+  A press counts on release, a hold right when BUTTON_HOLD_MS is reached.
+  Changing from one button to the other or to both without releasing all
+  of them in between counts as nothing.
+*/
+static void buttons_sample(uint8_t ms) {
+  static uint8_t last = 0, same_ms = 0, used = 0;
+  static uint16_t held_ms = 0;
+  uint8_t now = buttons_read();
+  uint8_t pressed = buttons.pressed;
+
+  if (now != last) {
+    last = now;
+    same_ms = 0;
+    return;
+  }
+  if (same_ms < BUTTON_DEBOUNCE_MS) {
+    same_ms += ms;
+    return;
+  }
+
+  if (now != pressed) {
+    if ( ! now && ! used) {
+      buttons_event(pressed, '+', '-');
+      if (pressed == PRESSED_PLUS && buttons.target > BUTTON_STEP)
+        buttons.target -= BUTTON_STEP;
+      if (pressed == PRESSED_MINUS && buttons.target < TEMP_MAX - BUTTON_STEP)
+        buttons.target += BUTTON_STEP;
+    }
+    used = now && pressed;
+    held_ms = 0;
+    buttons.pressed = now;
+  } else if (now && ! used) {
+    held_ms += ms;
+    if (held_ms >= BUTTON_HOLD_MS) {
+      buttons_event(now, 'o', 'c');
+      buttons_move = (now == PRESSED_PLUS) ? 'o' : 'c';
+      used = 1;
+    }
+  }
+}
+#endif /* BUTTONS */
+
+/* ---- LEDs -------------------------------------------------------------- */
+
+#ifdef LEDS
+/**
+  Patterns, one bit per slot, see LEDS.
+*/
+#define LED_ON    0xFF
+#define LED_OFF   0x00
+#define LED_FAST  0x55
+#define LED_SLOW  0x0F
+#define LED_FLASH 0x01
+
+static void leds_init(void) {
+
+  SET_OUTPUT(LED_Y);
+  SET_OUTPUT(LED_G);
+}
+
+/**
+  Advance the patterns by ms milliseconds and set both LEDs. Called by the
+  tick.
+
+  LED_Y shares port D with the sensors, whose pins get written from the
+  main loop without locking. Such a write may undo an LED change, so both
+  get set each time, not just when the slot changes.
+*/
+static void leds_tick(uint8_t ms) {
+  static uint8_t slot_ms = 0, slot = 1, measured = 0, flash = 0;
+  uint8_t pattern_y, pattern_g;
+
+  if ( ! conversion_done)
+    measured = 1;
+
+  slot_ms += ms;
+  if (slot_ms >= LED_SLOT_MS) {
+    slot_ms -= LED_SLOT_MS;
+    slot <<= 1;
+    if ( ! slot)
+      slot = 1;
+    flash = measured;
+    measured = 0;
+  }
+
+  pattern_g = usbConfiguration ? LED_ON : LED_FAST;
+
+  if (READ(MOT_OPEN) || READ(MOT_CLOSE)) {
+    pattern_y = LED_FAST;
+  } else if (answer.motor_moved == '!') {
+    pattern_y = LED_SLOW;
+  } else {
+    pattern_y = (answer.motor_moved == ' ') ? LED_ON : LED_OFF;
+    if (flash)
+      pattern_y = ~pattern_y;
+  }
+
+#ifdef SLEEP
+  if (usb_suspended) {
+    pattern_g = LED_FLASH;
+    // Other slot than LED_G, so they don't add up.
+    pattern_y = (answer.motor_moved == '!') ? LED_FLASH << 4 : LED_OFF;
+  }
+#endif
+
+  WRITE(LED_Y, pattern_y & slot);
+  WRITE(LED_G, pattern_g & slot);
+}
+#endif /* LEDS */
+
+/* ---- Tick -------------------------------------------------------------- */
+
+#ifdef HAVE_TICK
+/**
+  Tick, TICK_COUNTS Timer 0 counts are one millisecond.
+*/
+#define TICK_COUNTS (F_CPU / 64 / 1000)
+
+/**
+  Timer 0 runs free for osctune.h, so we can't set it to a period we like.
+  Instead, the compare value is moved ahead by one millisecond each time it
+  matches.
+*/
+static void tick_init(void) {
+
+  OCR0A = TCNT0 + TICK_COUNTS;
+  TIMSK |= (1 << OCIE0A);
+}
+
+/**
+  Reading ticks from the main loop needs locking, it's 16 bits.
+*/
+static uint16_t tick_now(void) {
+  uint16_t now;
+
+  cli();
+  now = ticks;
+  sei();
+
+  return now;
+}
+
+/**
+  What runs on each tick, ms milliseconds after the previous one. From the
+  tick interrupt, or with it masked, so it never runs twice at a time.
+*/
+static inline void tick_hooks(uint8_t ms) {
+#ifdef HEALTH
+  static uint16_t uptime_ms = 0;
+#endif
+
+#ifdef BUTTONS
+  buttons_sample(ms);
+#endif
+#ifdef LEDS
+  leds_tick(ms);
+#endif
+
+#ifdef HEALTH
+  uptime_ms += ms;
+  if (uptime_ms >= 1000) {
+    uptime_ms -= 1000;
+    health.uptime++;
+  }
+#endif
+}
+
+/**
+  ISR_NOBLOCK, like all our interrupts, see ISR(ANA_COMP_vect). Masking
+  its own source right after the prologue is in time, it can't match
+  again before OCR0A moves or Timer 0 wraps, 1.3 ms later.
+*/
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK) {
+#ifdef SLEEP
+  static uint8_t sof_last = 0, quiet = 0;
+#endif
+
+  TIMSK &= ~(1 << OCIE0A);
+
+  OCR0A += TICK_COUNTS;
+  ticks++;
+  tick_hooks(1);
+
+#ifdef SLEEP
+  if (usbSofCount != sof_last) {
+    sof_last = usbSofCount;
+    quiet = 0;
+    usb_suspended = 0;
+  } else if (quiet < SUSPEND_MS) {
+    quiet++;
+  } else {
+    usb_suspended = 1;
+  }
+#endif
+
+  TIMSK |= (1 << OCIE0A);
+}
+#endif /* HAVE_TICK */
+
+/* ---- Watchdog ---------------------------------------------------------- */
+
+#ifdef WATCHDOG
+/**
+  Progress flags, see watchdog_done().
+*/
+#define WATCHDOG_USB     0x01
+#define WATCHDOG_MEASURE 0x02
+#define WATCHDOG_CONTROL 0x04
+#define WATCHDOG_ALL     0x07
+
+/**
+  Reset causes, sent as is with the 'r' request. In .noinit, so it
+  survives resets other than power-on and brown-out.
+*/
+static struct {
+  uint8_t cause;            // MCUSR at the last reset.
+  uint8_t stalled;          // Progress flags missing at the last watchdog
+                            // reset, 0 if there was none yet.
+  uint16_t resets;          // Watchdog resets since power-on.
+} watchdog __attribute__((section(".noinit")));
+
+/**
+  Progress since the last feeding. Also in .noinit, to see after a
+  watchdog reset what was missing.
+*/
+static uint8_t watchdog_progress __attribute__((section(".noinit")));
+
+#ifdef SLEEP
+static uint16_t watchdog_fed = 0; // tick_now() at the last feeding.
+#endif
+
+/**
+  Take over after a reset, cause being what MCUSR said, and start the
+  watchdog.
+*/
+static void watchdog_init(uint8_t cause) {
+
+  if (cause & ((1 << PORF) | (1 << BORF))) {
+    // RAM content is random.
+    watchdog.stalled = 0;
+    watchdog.resets = 0;
+  }
+  if (cause & (1 << WDRF)) {
+    watchdog.stalled = ~watchdog_progress & WATCHDOG_ALL;
+    if (watchdog.resets < 0xFFFF)
+      watchdog.resets++;
+  }
+  watchdog.cause = cause;
+  watchdog_progress = 0;
+
+  wdt_enable(WATCHDOG_PERIOD);
+}
+
+/**
+  Record progress, one of the WATCHDOG_ flags, and feed the watchdog once
+  all of them are there. Main loop only.
+*/
+static void watchdog_done(uint8_t progress) {
+
+  watchdog_progress |= progress;
+  if (watchdog_progress == WATCHDOG_ALL) {
+    wdt_reset();
+    watchdog_progress = 0;
+#ifdef SLEEP
+    watchdog_fed = tick_now();
+#endif
+  }
+}
+#endif /* WATCHDOG */
+
+/* ---- Sleeping ---------------------------------------------------------- */
+
+#ifdef SLEEP
+/**
+  Bit in GPIOR0 set by ISR(WDT_OVERFLOW_vect), telling sleep_ms() that the
+  watchdog woke it, not D-.
+*/
+#define WDT_WOKE 1
+
+/**
+  The watchdog interrupt only wakes us from power-down, see sleep_ms().
+  SBI changes no flags, so there's nothing to save.
+*/
+ISR(WDT_OVERFLOW_vect, ISR_NAKED) {
+  __asm__ __volatile__ (
+    "sbi %0, %1"              "\n\t"
+    "reti"
+    :: "I" (_SFR_IO_ADDR(GPIOR0)), "I" (WDT_WOKE)
+  );
+}
+
+/**
+  Sleep for ms milliseconds. Usually in idle mode, woken at least every
+  tick. With the bus suspended and no measurement running, in power-down
+  mode, woken by the watchdog or by D- going low.
+
+  Only a low level on INT0 wakes from power-down, so that's what INT0
+  triggers on meanwhile. Until the edge trigger for V-USB is back, the USB
+  interrupt repeats while D- stays low, letting an instruction through in
+  between, which gets us there soon enough.
+*/
+static void sleep_ms(uint16_t ms) {
+  uint16_t start = tick_now();
+  uint8_t deep;
+
+  while (tick_now() - start < ms) {
+    deep = usb_suspended && conversion_done;
+#ifdef WATCHDOG
+    // Waking from power-down feeds the watchdog, see WATCHDOG.
+    if (tick_now() - watchdog_fed >= WATCHDOG_MS)
+      deep = 0;
+#endif
+    if (deep)
+      set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    else
+      set_sleep_mode(SLEEP_MODE_IDLE);
+
+    // SEI enables interrupts only after SLEEP, so no wakeup gets lost.
+    cli();
+    if (deep) {
+#ifdef WATCHDOG
+      // Interrupt first, reset only if that went unnoticed. 16 ms.
+      wdt_reset();
+      WDTCSR = (1 << WDCE) | (1 << WDE);
+      WDTCSR = (1 << WDIE) | (1 << WDE);
+#else
+      WDTCSR = (1 << WDIE);  // Interrupt only, 16 ms.
+#endif
+      USB_INTR_CFG &= ~USB_INTR_CFG_SET;
+    }
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+
+    if (deep) {
+      cli();
+      USB_INTR_CFG |= USB_INTR_CFG_SET;
+#ifdef WATCHDOG
+      wdt_enable(WATCHDOG_PERIOD);
+#else
+      WDTCSR = 0;
+#endif
+      if (GPIOR0 & (1 << WDT_WOKE)) {
+        GPIOR0 &= ~(1 << WDT_WOKE);
+        ticks += WDT_TICK_MS;
+        // Timer 0 runs again, so mask its tick while doing its job.
+        TIMSK &= ~(1 << OCIE0A);
+        sei();
+        tick_hooks(WDT_TICK_MS);
+        cli();
+        TIMSK |= (1 << OCIE0A);
+      }
+      sei();
+
+      // Resume or reset signaling.
+      if ( ! (USBIN & (1 << USBMINUS)))
+        usb_suspended = 0;
+    }
+  }
+}
+
+  #define wait_ms(ms) sleep_ms(ms)
+#else
+  #define wait_ms(ms) _delay_ms(ms)
+#endif /* SLEEP */
+
+/* ---- Oscillator calibration -------------------------------------------- */
+
+#ifdef OSCCAL_CACHE
+/**
+  Whether OSCCAL is about right: loaded from EEPROM or searched for.
+*/
+static uint8_t osccal_known = 0;
+
+/**
+  Load OSCCAL from EEPROM, if the value there is plausible: its complement
+  matches and it's above the factory value, which is for 8 MHz.
+*/
+static void osccal_init(void) {
+  uint8_t value = eeprom_read_byte(EEPROM_OSCCAL);
+
+  if ((uint8_t)~value == eeprom_read_byte(EEPROM_OSCCAL + 1) &&
+      value > OSCCAL && value < 0x80) {
+    OSCCAL = value;
+    osccal_known = 1;
+  }
+}
+
+/**
+  Search for OSCCAL by measuring USB frames, like calibrateOscillator() in
+  osccal.c, but for the 7 bits of OSCCAL on the ATtiny2313. A binary
+  search first, then the best of the neighbours. Must run right after a
+  USB reset, takes about 10 frames with interrupts disabled.
+*/
+static void osccal_search(void) {
+  uint8_t step = 0x40, trial = 0, best, value, last;
+  int target = (unsigned)(1499 * (double)F_CPU / 10.5e6 + 0.5);
+  int deviation, best_deviation;
+
+  if (osccal_known)
+    return;
+
+  cli();
+  do {
+    OSCCAL = trial + step;
+    if (usbMeasureFrameLength() < target)
+      trial += step;
+    step >>= 1;
+  } while (step);
+
+  best = trial;
+  best_deviation = 0x7FFF;
+  // OSCCAL is 7 bits only, it can't count past 0x7F.
+  last = trial < 0x7F ? trial + 1 : 0x7F;
+  for (value = trial ? trial - 1 : 0; value <= last; value++) {
+    OSCCAL = value;
+    deviation = usbMeasureFrameLength() - target;
+    if (deviation < 0)
+      deviation = -deviation;
+    if (deviation < best_deviation) {
+      best_deviation = deviation;
+      best = value;
+    }
+  }
+  OSCCAL = best;
+  sei();
+
+  osccal_known = 1;
+}
+
+/**
+  Store OSCCAL once enumeration worked, see OSCCAL_CACHE. Called after
+  each usbPoll().
+*/
+static void osccal_poll(void) {
+  static uint8_t saved = 0;
+  uint8_t value, stored;
+
+  if (saved || ! usbConfiguration)
+    return;
+  saved = 1;
+
+  value = OSCCAL;
+  stored = eeprom_read_byte(EEPROM_OSCCAL);
+  if ((uint8_t)~stored != eeprom_read_byte(EEPROM_OSCCAL + 1) ||
+      value > stored + OSCCAL_SLACK || value + OSCCAL_SLACK < stored) {
+    eeprom_update_byte(EEPROM_OSCCAL, value);
+    eeprom_update_byte(EEPROM_OSCCAL + 1, ~value);
+  }
+}
+#endif /* OSCCAL_CACHE */
+
+/* ---- Health counters --------------------------------------------------- */
+
+#ifdef HEALTH
+/**
+  Bookkeeping after each usbPoll(): the interval since the last one, how
+  far osctune.h has moved OSCCAL and when enumeration succeeded.
+*/
+static void health_poll(void) {
+  static uint16_t last = 0;
+  uint16_t now = tick_now();
+  uint8_t osccal = OSCCAL;
+
+#ifdef SLEEP
+  // Long intervals are fine without a host.
+  if (usb_suspended)
+    last = 0;
+#endif
+  if (last && now - last > health.usbpoll_max)
+    health.usbpoll_max = now - last;
+  last = now;
+
+  if (osccal < health.osccal_min)
+    health.osccal_min = osccal;
+  if (osccal > health.osccal_max)
+    health.osccal_max = osccal;
+
+  if ( ! health.enumerated && usbConfiguration)
+    health.enumerated = now;
+}
+#endif /* HEALTH */
+
+/* ---- Bandgap calibration ----------------------------------------------- */
+
+#ifdef BANDGAP_CALIBRATION
+/**
+  Read the bandgap calibration. Not calibrated, yet, means no scaling.
+*/
+static void bandgap_init(void) {
+
+  eeprom_read_block(&bandgap, EEPROM_BANDGAP, sizeof(bandgap));
+  if (bandgap.nominal == 0xFFFF || bandgap.measured == 0xFFFF ||
+      ! bandgap.nominal || ! bandgap.measured)
+    bandgap.nominal = bandgap.measured = 1;
+}
+
+/**
+  Calibrate, the current temp_c should read as nominal. temp_c is scaled
+  already, so scale it back first.
+*/
+static void bandgap_calibrate(uint16_t nominal) {
+
+  if (temp_c >= TEMP_MAX)
+    return;
+
+  bandgap.measured = (uint32_t)temp_c * bandgap.measured / bandgap.nominal;
+  bandgap.nominal = nominal;
+  eeprom_update_block(&bandgap, EEPROM_BANDGAP, sizeof(bandgap));
+}
+#endif /* BANDGAP_CALIBRATION */
+
+/* ---- Noise histogram --------------------------------------------------- */
+
+#ifdef HISTOGRAM
+/**
+  Start a new histogram, or stop with shift 0xFF. With low 0, bins get
+  centered on the first capture.
+*/
+static void histogram_start(uint16_t low, uint8_t shift) {
+
+  memset(&histogram, 0, sizeof(histogram));
+  if (shift < 16) {
+    histogram.state = HISTOGRAM_RUNNING;
+    histogram.shift = shift;
+    histogram.low = low;
+  }
+}
+
+/**
+  Sort one capture into its bin.
+*/
+static void histogram_add(uint16_t value) {
+  uint16_t half = (HISTOGRAM_BINS / 2) << histogram.shift;
+  uint8_t *count;
+
+  if ( ! histogram.low)
+    histogram.low = value > half ? value - half : 1;
+
+  if (value < histogram.low) {
+    count = &histogram.below;
+  } else {
+    value = (value - histogram.low) >> histogram.shift;
+    count = value < HISTOGRAM_BINS ? &histogram.bins[value] : &histogram.above;
+  }
+
+  if (++(*count) == 0xFF)
+    histogram.state = HISTOGRAM_FULL;
+}
+#endif /* HISTOGRAM */
+
+/* ---- Noise estimate ---------------------------------------------------- */
+
+#ifdef ADAPTIVE_HYSTERESIS
+/**
+  Welford's online variance, with exponential forgetting, in fixed point.
+
+  Taken of the differences between consecutive readings rather than of the
+  readings themselves, so a slow temperature change doesn't count as noise,
+  it just moves the mean. Variance of these differences is twice the
+  variance of the readings. Differences are limited to NOISE_CLAMP, a
+  single outlier can't blow up the estimate.
+*/
+#define NOISE_START ((THERMISTOR_HYSTERESIS / HYSTERESIS_FACTOR) * \
+                     (THERMISTOR_HYSTERESIS / HYSTERESIS_FACTOR))
+
+static struct {
+  uint16_t last;            // Previous reading, 0 for none.
+  int16_t mean;             // Mean difference, times 16.
+  int32_t variance;         // Variance of differences, times 16.
+} noise = { .variance = 16L * 2 * NOISE_START };
+
+/**
+  Account for a new reading. TEMP_MAX and TEMP_FAULT break the chain of
+  differences.
+*/
+static void noise_add(uint16_t reading) {
+  int32_t x, diff;
+
+  if (reading >= TEMP_MAX) {
+    noise.last = 0;
+    return;
+  }
+  if (noise.last) {
+    x = (int32_t)reading - noise.last;
+    if (x > NOISE_CLAMP)
+      x = NOISE_CLAMP;
+    if (x < -NOISE_CLAMP)
+      x = -NOISE_CLAMP;
+    x *= 16;
+
+    diff = x - noise.mean;
+    noise.mean += diff >> NOISE_SHIFT;
+    noise.variance += ((diff >> 2) * ((x - noise.mean) >> 2) -
+                       noise.variance) >> NOISE_SHIFT;
+  }
+  noise.last = reading;
+}
+
+/**
+  The hysteresis to use now, see ADAPTIVE_HYSTERESIS.
+*/
+static uint16_t noise_hysteresis(void) {
+  // Variance of readings, times 16.
+  uint32_t square = noise.variance > 0 ? noise.variance / 2 : 0;
+  uint16_t root = 0, bit, hysteresis;
+
+  // Integer square root, which is 4 times the standard deviation.
+  for (bit = 1 << 14; bit; bit >>= 1)
+    if ((uint32_t)(root | bit) * (root | bit) <= square)
+      root |= bit;
+
+  hysteresis = (uint32_t)root * HYSTERESIS_FACTOR / 4;
+  if (hysteresis < HYSTERESIS_MIN)
+    hysteresis = HYSTERESIS_MIN;
+  if (hysteresis > HYSTERESIS_MAX)
+    hysteresis = HYSTERESIS_MAX;
+
+  return hysteresis;
+}
+#endif /* ADAPTIVE_HYSTERESIS */
+
 /* ---- USB related functions --------------------------------------------- */
 
+#if defined HEALTH || defined OSCCAL_CACHE
+/**
+  Called by usbPoll() when a USB reset ends, see USB_RESET_HOOK in
+  usbconfig.h.
+*/
+void usb_reset(void) {
+
+#ifdef OSCCAL_CACHE
+  osccal_search();
+#endif
+#ifdef HEALTH
+  if (health.usb_resets < 0xFFFF)
+    health.usb_resets++;
+#endif
+}
+#endif
+
+#ifdef SERIAL_NUMBER
+/**
+  The serial number string descriptor, in RAM. V-USB sends it from here,
+  see USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER in usbconfig.h.
+*/
+static int serial_descriptor[1 + SERIAL_NUMBER_LEN];
+
+/**
+  Build the serial number descriptor from what's in EEPROM. The number ends
+  at the first byte not written, yet, or at SERIAL_NUMBER_LEN characters.
+*/
+static void serial_init(void) {
+  uint8_t i, c;
+
+  for (i = 0; i < SERIAL_NUMBER_LEN; i++) {
+    c = eeprom_read_byte(EEPROM_SERIAL_NUMBER + i);
+    if (c == 0xFF || c == 0x00)
+      break;
+    serial_descriptor[1 + i] = c;
+  }
+  serial_descriptor[0] = USB_STRING_DESCRIPTOR_HEADER(i);
+}
+
+/**
+  Write one character of the serial number. Takes effect on the next USB
+  enumeration, as hosts usually read the descriptor only once.
+*/
+static void serial_write(uint8_t position, uint8_t c) {
+
+  if (position < SERIAL_NUMBER_LEN) {
+    eeprom_update_byte(EEPROM_SERIAL_NUMBER + position, c);
+    serial_init();
+  }
+}
+
+/**
+  Only called for the serial number, as this is the only descriptor we
+  provide dynamically.
+*/
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+
+  usbMsgPtr = (void *)serial_descriptor;
+  return (uint8_t)serial_descriptor[0];
+}
+#endif /* SERIAL_NUMBER */
+
 /**
   We use control transfers to exchange data, up to 7 bytes at a time. As we
   don't have to comply with any standards, we can use all fields freely,
@@ -242,6 +1504,24 @@ static void motor_close(void) {
 
   These fields match the ones on terminal.py, for limitations see there.
 
+  Requests:
+
+    'c'  The reading, struct answer. Also the answer to anything unknown.
+         4 bytes, 8 bytes with MULTISENSOR_BROKEN.
+    'S'  Write character wValue of the serial number at position wIndex
+         (SERIAL_NUMBER only).
+    'h'  Health counters, struct health (HEALTH only).
+    'N'  Start histogram mode with bin width 2^wIndex and bin 0 starting at
+         wValue, 0 = automatic. wIndex 0xFF stops it (HISTOGRAM only).
+    'n'  The histogram, struct histogram (HISTOGRAM only).
+    'B'  Bandgap calibration, struct bandgap. With wValue not 0, calibrate
+         first, wValue being the right reading for now (BANDGAP_REFERENCE
+         without REFERENCE_RESISTOR only).
+    'e'  Button events, struct buttons (BUTTONS only).
+    'r'  Reset causes, struct watchdog (WATCHDOG only).
+    'u'  Room control, struct room (ROOM_CONTROL only).
+    'x'  Shadow regulation, struct shadow (SHADOW only).
+
     typedef struct usbRequest {
       uchar       bmRequestType;
       uchar       bRequest;
@@ -251,10 +1531,12 @@ static void motor_close(void) {
     } usbRequest_t;
 */
 usbMsgLen_t usbFunctionSetup(uchar data[8]) {
-#ifdef CAN_AFFORD_USB_COMMANDS
-  uint8_t len = 0;
+#ifdef HAVE_USB_REQUESTS
   // Cast to structured data for parsing.
   usbRequest_t *rq = (void *)data;
+#endif
+#ifdef CAN_AFFORD_USB_COMMANDS
+  uint8_t len = 0;
 
   if (rq->bRequest == 'c') {
     reply.value[0] = temp_c;
@@ -273,10 +1555,96 @@ usbMsgLen_t usbFunctionSetup(uchar data[8]) {
   return len;
 #endif
 
+#ifdef SERIAL_NUMBER
+  if (rq->bRequest == 'S') {
+    serial_write(rq->wIndex.bytes[0], rq->wValue.bytes[0]);
+    return 0;
+  }
+#endif
+
+#ifdef HEALTH
+  if (rq->bRequest == 'h') {
+    health.osccal = OSCCAL;
+    usbMsgPtr = (void *)&health;
+    return sizeof(health);
+  }
+#endif
+
+#ifdef HISTOGRAM
+  if (rq->bRequest == 'N') {
+    histogram_start(rq->wValue.word, rq->wIndex.bytes[0]);
+    return 0;
+  }
+  if (rq->bRequest == 'n') {
+    usbMsgPtr = (void *)&histogram;
+    return sizeof(histogram);
+  }
+#endif
+
+#ifdef BANDGAP_CALIBRATION
+  if (rq->bRequest == 'B') {
+    if (rq->wValue.word)
+      bandgap_calibrate(rq->wValue.word);
+    usbMsgPtr = (void *)&bandgap;
+    return sizeof(bandgap);
+  }
+#endif
+
+#ifdef BUTTONS
+  if (rq->bRequest == 'e') {
+    usbMsgPtr = (void *)&buttons;
+    return sizeof(buttons);
+  }
+#endif
+
+#ifdef WATCHDOG
+  if (rq->bRequest == 'r') {
+    usbMsgPtr = (void *)&watchdog;
+    return sizeof(watchdog);
+  }
+#endif
+
+#ifdef ROOM_CONTROL
+  if (rq->bRequest == 'u') {
+    room.temp_r = temp_r;
+    usbMsgPtr = (void *)&room;
+    return sizeof(room);
+  }
+#endif
+
+#ifdef SHADOW
+  if (rq->bRequest == 'x') {
+    usbMsgPtr = (void *)&shadow;
+    return sizeof(shadow);
+  }
+#endif
+
+#ifdef MULTISENSOR_BROKEN
+  answer.temp_v = temp_v;
+  answer.temp_r = temp_r;
+#endif
   usbMsgPtr = (void *)&answer;
   return sizeof(answer);
 }
 
+/**
+  usbPoll() plus bookkeeping to do after it.
+*/
+static void poll_usb(void) {
+
+  usbPoll();
+#ifdef WATCHDOG
+  watchdog_done(WATCHDOG_USB);
+#endif
+#ifdef HEALTH
+  health_poll();
+#endif
+#ifdef OSCCAL_CACHE
+  osccal_poll();
+#endif
+}
+
+#ifndef ADAPTIVE_DISCHARGE
 /**
   Poll USB while doing nothing for sufficient time to allow the ADC capacitor
   to discharge. If there's something to do on the USB bus, the delay can be
@@ -289,13 +1657,56 @@ static void poll_a_second(void) {
 
   // Count to at least 5, else binary size grows significantly (50 bytes).
   for (i = 0; i < 25; i++) {
-    usbPoll();
-    _delay_ms(40);
+    poll_usb();
+    wait_ms(40);
   }
 }
+#endif
 
 /* ---- Temperature measurements ------------------------------------------ */
 
+/**
+  All sensors are on port D, which allows handling them by masks.
+
+  Port D also has the USB pins. Changing it by read-modify-write is fine
+  anyways, because V-USB's interrupt always leaves them at 0, as found.
+*/
+#define TEMP_PORT TEMP_C_WPORT
+#define TEMP_DDR  TEMP_C_DDR
+#if defined MULTISENSOR_BROKEN || defined CASCADE
+  #define TEMP_MASK_V MASK(TEMP_V_PIN)
+#else
+  #define TEMP_MASK_V 0
+#endif
+#if defined MULTISENSOR_BROKEN || defined ROOM_CONTROL
+  #define TEMP_MASK_R MASK(TEMP_R_PIN)
+#else
+  #define TEMP_MASK_R 0
+#endif
+#define TEMP_MASK_SENSORS (MASK(TEMP_C_PIN) | TEMP_MASK_V | TEMP_MASK_R)
+#ifdef REFERENCE_RESISTOR
+  #define TEMP_MASK (TEMP_MASK_SENSORS | MASK(TEMP_REF_PIN))
+#else
+  #define TEMP_MASK TEMP_MASK_SENSORS
+#endif
+#if defined MULTISENSOR_BROKEN || defined REFERENCE_RESISTOR || \
+    defined CASCADE || defined ROOM_CONTROL
+  #define TEMP_SEVERAL
+#endif
+
+/**
+  Stop loading and discharge the capacitor through all sensors. With more
+  than one sensor, the ones not measured are switched to inputs while
+  measuring, else they'd drain the capacitor, see temp_start().
+*/
+static inline void temp_discharge(void) {
+
+  TEMP_PORT &= ~TEMP_MASK;
+#ifdef TEMP_SEVERAL
+  TEMP_DDR |= TEMP_MASK;
+#endif
+}
+
 /**
   Initialise temperature measurements by the Analog Comparator.
 */
@@ -306,20 +1717,208 @@ static void temp_init(void) {
     connected to AIN0 (pin 12, PB0) or to an internal voltage reference.
     For now we use the external one, as our board provides such a thing.
 
-    Analog Comparator and its interrupt is enabled all the time, we protect
-    against taking unwanted triggers into account in the interrupt routine.
+    Analog Comparator is enabled all the time. Its interrupt masks itself
+    on the first trigger and temp_start() unmasks it for the next one.
   */
+#ifdef BANDGAP_REFERENCE
+  // Bandgap on the positive input, so the comparator output falls when the
+  // capacitor on AIN1 gets loaded past it.
+  ACSR = (1 << ACBG) | (1 << ACIE) | (1 << ACIS1);
+#else
   ACSR = (1 << ACIE) | (1 << ACIS0) | (1 << ACIS1);
+#endif
 
-  // Start Timer 1 with prescaling f/8.
+  // Start Timer 1 with prescaling f/8. Its overflows extend readings.
   TCCR1B = (1 << CS11);
+  TIMSK |= (1 << TOIE1);
 
   SET_OUTPUT(TEMP_C);
-#ifdef MULTISENSOR_BROKEN
+#if defined MULTISENSOR_BROKEN || defined CASCADE
   SET_OUTPUT(TEMP_V);
+#endif
+#if defined MULTISENSOR_BROKEN || defined ROOM_CONTROL
   SET_OUTPUT(TEMP_R);
 #endif
+#ifdef REFERENCE_RESISTOR
+  SET_OUTPUT(TEMP_REF);
+#endif
+}
+
+#ifdef SOF_SYNC
+/**
+  Wait for the moment to start a measurement expected to count up to
+  expected: the next SOF, plus enough time to let the comparator trigger
+  at SOF_EDGE_PHASE in a later frame. Takes up to two milliseconds.
+
+  Uses Timer 1 for waiting. That's safe, the comparator interrupt doesn't
+  read it with conversion_done still set from the last measurement.
+*/
+static void sof_sync(uint16_t expected) {
+  uint8_t sof = usbSofCount;
+  uint16_t delay;
+
+  delay = (SOF_EDGE_PHASE + SOF_FRAME_COUNTS - expected % SOF_FRAME_COUNTS) %
+          SOF_FRAME_COUNTS;
+
+  // Don't wait forever, the host may have suspended the bus.
+  TCNT1H = 0;
+  TCNT1L = 0;
+  while (usbSofCount == sof && TCNT1 < 2 * SOF_FRAME_COUNTS)
+    ;
+
+  TCNT1H = 0;
+  TCNT1L = 0;
+  while (TCNT1 < delay)
+    ;
+}
+#endif
+
+/**
+  Start a measurement of the sensor(s) in mask. expected is the reading
+  this measurement likely results in.
+*/
+static void temp_start(uint8_t mask, uint16_t expected) {
+
+#ifdef SOF_SYNC
+  sof_sync(expected);
+#endif
+
+  // Clear Timer 1. Write the high byte first to make it an atomic write.
+  TCNT1H = 0;
+  TCNT1L = 0;
+  TIFR = (1 << TOV1);
+  temp_overflows = 0;
+
+  conversion_done = 0;
+  temp_temp = TEMP_FAULT;
+
+  /**
+    The comparator interrupt masked itself on the last capture, see
+    ISR(ANA_COMP_vect). Triggers since then are pending in ACI; as the
+    comparator runs all the time, that's about 3 per measurement. Drop
+    them and unmask. SBI on ACSR touches the given bit only on the
+    ATtiny2313, so it doesn't clear ACI on the way.
+  */
+#ifdef HEALTH
+  if ((ACSR & (1 << ACI)) && health.retriggers < 0xFFFF)
+    health.retriggers++;
+#endif
+  ACSR |= (1 << ACI);
+  ACSR |= (1 << ACIE);
+
+  // Start loading the capacitor and as such, ADC.
+#ifdef TEMP_SEVERAL
+  TEMP_DDR &= ~TEMP_MASK | mask;
+#endif
+  TEMP_PORT |= mask;
+}
+
+#ifdef ADAPTIVE_DISCHARGE
+/**
+  Measure the sensor(s) in mask for about a second, as often as
+  discharging allows, see ADAPTIVE_DISCHARGE. Returns the average reading,
+  TEMP_FAULT if there was none. expected is the reading likely to result.
+
+  conversion_done is 1 after the comparator interrupt caught a reading and
+  2 after we took it into account here.
+*/
+static uint16_t temp_channel(uint8_t mask, uint16_t expected) {
+  uint32_t sum = 0;
+  uint8_t samples = 0, step;
+  uint16_t cycle = 0, wait = 0;
+
+  temp_start(mask, expected);
+  for (step = 0; step < DISCHARGE_STEPS; step++) {
+    // Poll USB about every 32 ms.
+    if ((step & 0x07) == 0) {
+      poll_usb();
+    }
+    wait_ms(DISCHARGE_STEP_MS);
+
+    if (conversion_done == 1) {
+      conversion_done = 2;
+      if (temp_temp == TEMP_FAULT)
+        return TEMP_FAULT;
+      sum += temp_capture;
+      samples++;
+      wait = temp_capture / DISCHARGE_DIVISOR + 1;
+      // Loading takes another 1/DISCHARGE_RATIO, plus some margin.
+      cycle = wait + wait / 4 + 1;
+    } else if (wait && --wait == 0 && DISCHARGE_STEPS - step > cycle) {
+      temp_start(mask, temp_temp);
+    }
+  }
+
+  // No time left for this one. A missing sensor ends on TEMP_TIMEOUT.
+  if ( ! conversion_done)
+    temp_discharge();
+
+  if ( ! samples)
+    return TEMP_FAULT;
+  sum /= samples;
+
+  return sum > TEMP_MAX ? TEMP_MAX : sum;
+}
+#else
+/**
+  Measure the sensor(s) in mask once, then let the capacitor discharge for
+  the rest of a second. Returns the reading, TEMP_FAULT if there was none.
+  expected is the reading likely to result.
+*/
+static uint16_t temp_channel(uint8_t mask, uint16_t expected) {
+
+  temp_start(mask, expected);
+
+  // While ADC does its work, wait a second while polling USB.
+  poll_a_second();
+
+  return temp_temp;
+}
+#endif /* ADAPTIVE_DISCHARGE */
+
+/**
+  Moving average with 8 values, new readings count in at about 12%. eight
+  holds eight times the average. Starts over with the first reading after
+  a fault.
+*/
+static void temp_smooth(uint16_t *average, uint32_t *eight, uint16_t reading) {
+
+  if (reading == TEMP_FAULT) {
+    *average = TEMP_FAULT;
+  } else {
+    if (*average == TEMP_FAULT)
+      *eight = reading * 8L;
+    else
+      *eight = *eight - *average + reading;
+    *average = (*eight /*+ 4*/) / 8;  // '+ 4' for rounding
+  }
+}
+
+#if defined REFERENCE_RESISTOR || defined BANDGAP_CALIBRATION
+/**
+  A reading relative to the reference resistor, see REFERENCE_RESISTOR, or
+  scaled by the bandgap calibration, see BANDGAP_REFERENCE. Without a valid
+  reference, there's no valid reading either.
+*/
+static uint16_t temp_ratio(uint16_t reading) {
+  uint32_t ratio;
+
+  if (reading >= TEMP_MAX)
+    return reading;
+#ifdef REFERENCE_RESISTOR
+  if (temp_ref == TEMP_FAULT)
+    return TEMP_FAULT;
+
+  ratio = (uint32_t)reading * REFERENCE_NOMINAL / temp_ref;
+#else
+  ratio = (uint32_t)reading * bandgap.nominal / bandgap.measured;
+#endif
+
+  return ratio < TEMP_MAX ? ratio : TEMP_MAX;
 }
+#else
+  #define temp_ratio(reading) (reading)
+#endif
 
 /**
   Measure temperature sensor C.
@@ -345,93 +1944,197 @@ static void temp_init(void) {
 */
 static void temp_measure(void) {
 
+#ifdef REFERENCE_RESISTOR
   /**
-    First step is to measure the sensor connected to the ISTA counter.
+    Measure the reference first, all other readings are relative to it.
   */
-  // Clear Timer 1. Write the high byte first to make it an atomic write.
-  TCNT1H = 0;
-  TCNT1L = 0;
-
-  // Start loading the capacitor and as such, ADC.
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_C, 1);
+  temp_smooth(&temp_ref, &temp_ref_eight,
+              temp_channel(MASK(TEMP_REF_PIN), temp_ref));
+#endif
 
-  // While ADC does its work, wait a second while polling USB.
-  poll_a_second();
+  /**
+    First step is to measure the sensor connected to the ISTA counter.
+  */
+  temp_temp = temp_ratio(temp_channel(MASK(TEMP_C_PIN), temp_c));
 
   // Store the new ADC reading with smoothing. Note that we do many ADC
   // ADC readings between evaluations for the control algorithm, so the
   // reading is well smoothed in between and response to temperature changes
   // is as quick as without averaging.
-  #if TARGET_TEMPERATURE < 7000
-    // Use a moving average with 8 values. New readings count in at about 12%.
-    temp_temp_eight -= temp_c;
-    temp_temp_eight += temp_temp;
-    temp_c = (temp_temp_eight /*+ 4*/) / 8;  // '+ 4' for rounding
-  #else
-    // Use a two-point moving average, which allows readings up to 32767.
-    temp_c = (temp_temp + temp_c + 1) / 2;
-  #endif
+  temp_smooth(&temp_c, &temp_temp_eight, temp_temp);
+#ifdef ADAPTIVE_HYSTERESIS
+  noise_add(temp_temp);
+#endif
 
-#ifdef MULTISENSOR_BROKEN
+#ifdef CASCADE
+  /**
+    Do the same for the sensor connected to the radiator valve. Smoothed,
+    it's used for controlling as well.
+  */
+  temp_smooth(&temp_v, &temp_v_eight,
+              temp_ratio(temp_channel(MASK(TEMP_V_PIN), temp_v)));
+#elif defined MULTISENSOR_BROKEN
   /**
     Do the same for the sensor connected to the radiator valve.
   */
-  TCNT1H = 0;
-  TCNT1L = 0;
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_V, 1);
-  poll_a_second();
-  temp_v = temp_temp;
+  temp_v = temp_ratio(temp_channel(MASK(TEMP_V_PIN), temp_v));
+#endif
 
+#ifdef ROOM_CONTROL
+  /**
+    Third and last, measure the room temperature sensor. Smoothed, it's
+    used for controlling.
+  */
+  temp_smooth(&temp_r, &temp_r_eight,
+              temp_ratio(temp_channel(MASK(TEMP_R_PIN), temp_r)));
+#elif defined MULTISENSOR_BROKEN
   /**
     Third and last, measure the room temperature sensor.
   */
-  TCNT1H = 0;
-  TCNT1L = 0;
-  conversion_done = 0;
-  temp_temp = 0;
-  WRITE(TEMP_R, 1);
-  poll_a_second();
-  temp_r = temp_temp;
+  temp_r = temp_ratio(temp_channel(MASK(TEMP_R_PIN), temp_r));
+#endif
+
+#ifdef WATCHDOG
+  watchdog_done(WATCHDOG_MEASURE);
+#endif
+}
+
+#ifdef HISTOGRAM
+/**
+  Histogram mode: one raw capture of TEMP_C, as fast as the capacitor
+  allows. No smoothing, no regulation, the valve stays where it is.
+*/
+static void histogram_measure(void) {
+  uint8_t i;
+
+  temp_start(MASK(TEMP_C_PIN), temp_c);
+
+  for (i = 0; i < HISTOGRAM_POLLS; i++) {
+    poll_usb();
+    wait_ms(20);
+  }
+#ifdef WATCHDOG
+  watchdog_done(WATCHDOG_MEASURE);
 #endif
 
-  // Done.
+  // HISTOGRAM_POLLS outlasts TEMP_TIMEOUT, so the capture has ended by now.
+  if (temp_temp != TEMP_FAULT && histogram.state == HISTOGRAM_RUNNING)
+    histogram_add(temp_temp);
 }
+#endif /* HISTOGRAM */
 
 /**
   Read out the temperature measurement result. Timer 1 is started at zero in
   temp_measure() and counts up until this interrupt is triggered. By reading
   Timer 1 here we get a measurement.
+
+  V-USB needs INT0 served within 25 cycles, which the prologue alone would
+  exceed, so interrupts get enabled right away. Checked by
+  timing/isr-cycles.py at build time. The comparator bounces, so before
+  that, its interrupt gets masked; otherwise each bounce would nest
+  another prologue onto the stack. This takes a naked stub, ISR_NOBLOCK
+  would enable interrupts first thing. temp_start() unmasks it for the
+  next measurement, there's nothing to catch before.
+
+  With each handler masking itself (or, for Timer 1 overflows, not able
+  to fire again within 40 ms), the worst case nesting is tick, Timer 1
+  overflow and comparator once each, plus V-USB's INT0 on top. About 20
+  bytes of stack per level of ours.
+*/
+ISR(ANA_COMP_vect, ISR_NAKED) {
+  __asm__ __volatile__ (
+    "cbi %0, %1"              "\n\t"
+    "rjmp __vector_temp_capture"
+    :: "I" (_SFR_IO_ADDR(ACSR)), "I" (ACIE)
+  );
+}
+
+/**
+  Body of ISR(ANA_COMP_vect), an ISR_NOBLOCK interrupt handler of its own.
+  The name starts with __vector to keep avr-gcc from warning about a
+  misspelled one.
 */
-ISR(ANA_COMP_vect) {
+void __vector_temp_capture(void) ISR_NOBLOCK __attribute__((used));
+void __vector_temp_capture(void) {
 
-  /**
-    As the ACD runs all the time, we usually receive multiple triggers per
-    measurement. Tests indicated about 3 trigger on each. Avoid this by
-    ignoring additional triggers.
-  */
+  // A late trigger after a timeout finds the conversion done already.
   if ( ! conversion_done) {
-    // Read result. 16-bit values have to be read atomically. As this is
-    // interrupt time, interrupts are already locked, so no special care
-    // required.
-    temp_temp = TCNT1;
+    uint16_t count;
+    uint8_t overflows;
+
+    // Timer 1 and its overflows have to be read together. An overflow not
+    // counted, yet, is pending in TOV1, or, with ISR(TIMER1_OVF_vect)
+    // entered, in TEMP_OVERFLOWED. It belongs to this capture only if the
+    // count wrapped before we read it, then the count is small.
+    cli();
+    count = TCNT1;
+    overflows = temp_overflows;
+    if (((TIFR & (1 << TOV1)) || (GPIOR0 & (1 << TEMP_OVERFLOWED))) &&
+        count < 0x8000)
+      overflows++;
+    sei();
+
+    temp_capture = ((uint32_t)overflows << 16) | count;
+    temp_temp = temp_capture > TEMP_MAX ? TEMP_MAX : temp_capture;
     conversion_done = 1;
 
     // Start discharging.
-    WRITE(TEMP_C, 0);
-#ifdef MULTISENSOR_BROKEN
-    WRITE(TEMP_V, 0);
-    WRITE(TEMP_R, 0);
+    temp_discharge();
+  }
+}
+
+/**
+  Count Timer 1 overflows while measuring and give up after TEMP_TIMEOUT
+  of them. This bounds the time a measurement can take, missing sensors
+  included.
+
+  Like ISR(ANA_COMP_vect), a naked stub in front of an ISR_NOBLOCK body.
+  Entering clears TOV1, so until the body counted the overflow, the stub's
+  TEMP_OVERFLOWED tells the comparator interrupt about it.
+*/
+ISR(TIMER1_OVF_vect, ISR_NAKED) {
+  __asm__ __volatile__ (
+    "sbi %0, %1"              "\n\t"
+    "rjmp __vector_temp_overflow"
+    :: "I" (_SFR_IO_ADDR(GPIOR0)), "I" (TEMP_OVERFLOWED)
+  );
+}
+
+void __vector_temp_overflow(void) ISR_NOBLOCK __attribute__((used));
+void __vector_temp_overflow(void) {
+
+  cli();
+  GPIOR0 &= ~(1 << TEMP_OVERFLOWED);
+  if ( ! conversion_done)
+    temp_overflows++;
+  sei();
+
+  if ( ! conversion_done && temp_overflows >= TEMP_TIMEOUT) {
+    temp_discharge();
+    temp_temp = TEMP_FAULT;
+    conversion_done = 1;
+#ifdef HEALTH
+    if (health.timeouts < 0xFFFF)
+      health.timeouts++;
 #endif
   }
 }
 
 /* ---- Application ------------------------------------------------------- */
 
+/**
+  How long the host gets to see us gone after a reset, so it enumerates
+  again. Skipped after power-on with OSCCAL_CACHE.
+*/
+#define USB_DISCONNECT_MS 300
+
 static void hardware_init(void) {
+#if defined OSCCAL_CACHE || defined WATCHDOG
+  uint8_t reset_cause = MCUSR;
+
+  // After a watchdog reset, WDRF keeps the watchdog on until cleared.
+  MCUSR = 0;
+#endif
 
   /**
     Even if you don't use the watchdog, turn it off here. On newer devices,
@@ -446,13 +2149,58 @@ static void hardware_init(void) {
 
   motor_init();
 
+#ifdef LEDS
+  leds_init();
+#endif
+
+#ifdef SERIAL_NUMBER
+  serial_init();
+#endif
+
+#ifdef HAVE_TICK
+  tick_init();
+#endif
+
+#ifdef BANDGAP_CALIBRATION
+  bandgap_init();
+#endif
+
+#ifdef WATCHDOG
+  watchdog_init(reset_cause);
+#endif
+
+#ifdef OSCCAL_CACHE
+  osccal_init();
+
+  // Fresh from power-on, there's nothing to disconnect from.
+  if (reset_cause & (1 << PORF))
+    return;
+#endif
+
   usbDeviceDisconnect();
-  _delay_ms(300);
+  _delay_ms(USB_DISCONNECT_MS);
   usbDeviceConnect();
+
+#ifdef HAVE_TICK
+  // Interrupts are still off, the tick didn't count this.
+  ticks = USB_DISCONNECT_MS;
+#endif
 }
 
 int main(void) {
   uint16_t time = 0;
+  uint16_t target = TARGET_TEMPERATURE;
+#ifdef ROOM_CONTROL
+  uint16_t room_time = 0;
+  uint16_t room_target = ROOM_TARGET;
+#endif
+#ifdef CASCADE
+  uint16_t valve_time = 0;
+  uint16_t valve_target = 0; // TEMP_V target, 0 = none yet.
+#endif
+#ifdef EMERGENCY
+  uint8_t far, excursion = 0; // Outside the band, acted on that already.
+#endif
   //uint16_t temp_last = 0; // See struct answer above.
 
   hardware_init();
@@ -461,13 +2209,115 @@ int main(void) {
 
   for (;;) {    /* main event loop */
 
+#ifdef HISTOGRAM
+    if (histogram.state) {
+      histogram_measure();
+  #ifdef WATCHDOG
+      // Regulation is off on purpose.
+      watchdog_done(WATCHDOG_CONTROL);
+  #endif
+      continue;
+    }
+#endif
+
     temp_measure(); // Also polls USB.
 
+#ifdef BUTTONS
+    if (buttons_move) {
+      if (buttons_move == 'o')
+        motor_open();
+      else
+        motor_close();
+      buttons_move = 0;
+      time = 0;
+#ifdef CASCADE
+      valve_time = 0;
+#endif
+    }
+#endif
+
+    /**
+      Acting on a faulty sensor would drive the valve to one of its ends.
+      Hold it instead and tell the host with '!'. Regulation starts over
+      when the sensor is back.
+    */
+    if (temp_c == TEMP_FAULT) {
+      answer.temp_last = TEMP_FAULT;
+      answer.motor_moved = '!';
+      time = 0;
+#ifdef WATCHDOG
+      // Holding is the decision, a reset wouldn't bring the sensor back.
+      watchdog_done(WATCHDOG_CONTROL);
+#endif
+      continue;
+    }
+
+#ifdef BUTTONS
+    cli();
+  #ifdef ROOM_CONTROL
+    room_target = buttons.target;
+  #else
+    target = buttons.target;
+  #endif
+    sei();
+#endif
+
+#ifdef ROOM_CONTROL
+    /**
+      Move the TEMP_C target, see ROOM_CONTROL. Readouts are the other way
+      around than temperatures, a cooler radiator has a higher target.
+    */
+    if (temp_r != TEMP_FAULT) {
+      if (temp_r > temp_c)
+        room.units += temp_r - temp_c;
+      room.rounds++;
+
+      room_time++;
+      if (room_time > ROOM_RESPONSE_TIME) {
+        if (temp_r > room_target + ROOM_HYSTERESIS)
+          room.target -= ROOM_STEP;
+        else if (temp_r < room_target - ROOM_HYSTERESIS)
+          room.target += ROOM_STEP;
+        else
+          room.target += ROOM_DRIFT;
+
+        if (room.target < ROOM_C_MIN)
+          room.target = ROOM_C_MIN;
+        if (room.target > ROOM_C_MAX)
+          room.target = ROOM_C_MAX;
+        room_time = 0;
+      }
+    }
+    target = room.target;
+#endif
+
     time++;
-    // Loop count here also depends on how much poll_a_second() actually
-    // delays and how often temp_measure() calls poll_a_second().
-    if (time > RADIATOR_RESPONSE_TIME) {
+    // Loop count here also depends on how much temp_channel() actually
+    // delays and how often temp_measure() calls temp_channel().
+    //
+    // The emergency band check relies on unsigned wrap-around: readings
+    // from target - EMERGENCY_HYSTERESIS to target + EMERGENCY_HYSTERESIS
+    // map to 0..2 * EMERGENCY_HYSTERESIS, everything else above.
+#ifdef EMERGENCY
+    far = (uint16_t)(temp_c - target + EMERGENCY_HYSTERESIS) >
+          2 * EMERGENCY_HYSTERESIS;
+    if ( ! far)
+      excursion = 0;
+#endif
+    if (time > RADIATOR_RESPONSE_TIME
+#ifdef EMERGENCY
+        || (far && ! excursion && time > EMERGENCY_RESPONSE_TIME)
+#endif
+       ) {
       uint16_t temp_future = 0; // See struct answer above.
+      uint16_t hysteresis = THERMISTOR_HYSTERESIS;
+#ifdef CASCADE
+      uint8_t acting;
+#endif
+
+#ifdef ADAPTIVE_HYSTERESIS
+      hysteresis = noise_hysteresis();
+#endif
 
       /**
         This is the regulation algorithm. A tricky thing, because temperature
@@ -494,25 +2344,139 @@ int main(void) {
         would be a moving average, but we have neither sufficient Flash nor
         sufficient RAM to implement such a thing.
       */
-      // Extrapolation. Take care of the sign.
-      temp_future = temp_c + PREDICTION_STEEPNESS *
-                    ((int16_t)temp_c - (int16_t)answer.temp_last);
-
+      // No trend to extrapolate right after a sensor fault.
+      if (answer.temp_last == TEMP_FAULT)
+        answer.temp_last = temp_c;
+
+      // Extrapolation. Take care of the sign. Not for an emergency, see
+      // EMERGENCY.
+      temp_future = temp_c;
+#ifdef EMERGENCY
+      if (time > RADIATOR_RESPONSE_TIME)
+#endif
+        temp_future += PREDICTION_STEEPNESS *
+                       ((int16_t)temp_c - (int16_t)answer.temp_last);
+
+#ifdef CASCADE
+      // Act according to the prediction, on the TEMP_V target. Not before
+      // the inner loop set one, not with TEMP_V faulty.
+      acting = valve_target && temp_v != TEMP_FAULT;
+      if (acting) {
+        int16_t windup;
+
+        if (temp_future < (target - hysteresis))
+          valve_target += CASCADE_STEP;
+        else
+        if (temp_future > (target + hysteresis))
+          valve_target -= CASCADE_STEP;
+
+        windup = valve_target - temp_v;
+        if (windup > CASCADE_WINDUP)
+          valve_target = temp_v + CASCADE_WINDUP;
+        if (windup < -CASCADE_WINDUP)
+          valve_target = temp_v - CASCADE_WINDUP;
+      }
+#else
       // Act according to the prediction.
-      if (temp_future < (TARGET_TEMPERATURE - THERMISTOR_HYSTERESIS)) {
+      if (temp_future < (target - hysteresis)) {
         motor_close();
         answer.motor_moved = '-';
       } else
-      if (temp_future > (TARGET_TEMPERATURE + THERMISTOR_HYSTERESIS)) {
+      if (temp_future > (target + hysteresis)) {
         motor_open();
         answer.motor_moved = '+';
       } else {
         answer.motor_moved = ' ';
       }
+#endif
+
+#ifdef SHADOW
+      /**
+        Decide again, once like above and once like the candidate, and
+        count. Works the same with CASCADE, where the decision moves the
+        TEMP_V target instead of the valve. Only decisions the active
+        regulation actually took count.
+      */
+#ifdef CASCADE
+      if (acting)
+#endif
+      {
+        char active = ' ', candidate = ' ';
+
+        if (temp_future < (target - hysteresis))
+          active = '-';
+        else
+        if (temp_future > (target + hysteresis))
+          active = '+';
+
+        temp_future = temp_c + SHADOW_STEEPNESS *
+                      ((int16_t)temp_c - (int16_t)answer.temp_last);
+        if (temp_future < (target - SHADOW_HYSTERESIS))
+          candidate = '-';
+        else
+        if (temp_future > (target + SHADOW_HYSTERESIS))
+          candidate = '+';
+
+        shadow.decisions++;
+        if (active == candidate)
+          shadow.agreed++;
+        else
+        if (active != ' ' && candidate != ' ')
+          shadow.opposed++;
+        if (active != ' ')
+          shadow.active_moves++;
+        if (candidate != ' ')
+          shadow.shadow_moves++;
+        shadow.active = active;
+        shadow.shadow = candidate;
+      }
+#endif
 
       time = 0;
       answer.temp_last = temp_c;
+      answer.decisions++;
+#ifdef EMERGENCY
+      // Acted outside the band, wait for the result.
+      excursion = far;
+#endif
     }
+
+#ifdef WATCHDOG
+    // This round's reading went into a decision, acting or waiting.
+    watchdog_done(WATCHDOG_CONTROL);
+#endif
+
+#ifdef CASCADE
+    /**
+      Inner loop of CASCADE, moving the valve to get TEMP_V to the target
+      set above. A valve body sensor fault holds the valve, like one of
+      TEMP_C does.
+    */
+    if (temp_v == TEMP_FAULT) {
+      answer.motor_moved = '!';
+      valve_time = 0;
+      continue;
+    }
+    if ( ! valve_target)
+      valve_target = temp_v;
+
+    valve_time++;
+    if (valve_time > CASCADE_RESPONSE_TIME) {
+      if (temp_v < (valve_target - CASCADE_HYSTERESIS)) {
+        motor_close();
+        answer.motor_moved = '-';
+      } else
+      if (temp_v > (valve_target + CASCADE_HYSTERESIS)) {
+        motor_open();
+        answer.motor_moved = '+';
+      } else {
+        answer.motor_moved = ' ';
+      }
+
+      valve_time = 0;
+      answer.decisions++;
+    }
+#endif
   }
 }
 
@@ -98,7 +98,7 @@
 #define LED_Y_PWM       NULL
 
 // Green LED on PB2.
-#define LED_G_PIN       PINB6
+#define LED_G_PIN       PINB2
 #define LED_G_RPORT     PINB
 #define LED_G_WPORT     PORTB
 #define LED_G_DDR       DDRB
@@ -126,6 +126,14 @@
 #define TEMP_R_DDR      DDRD
 #define TEMP_R_PWM      &OC0B
 
+// Reference resistor in place of a thermistor, see REFERENCE_RESISTOR in
+// main.c. Not on the board, fit it between PD0 and the capacitor.
+#define TEMP_REF_PIN    PIND0
+#define TEMP_REF_RPORT  PIND
+#define TEMP_REF_WPORT  PORTD
+#define TEMP_REF_DDR    DDRD
+#define TEMP_REF_PWM    NULL
+
 // Valve motor, open direction.
 #define MOT_OPEN_PIN    PINB3
 #define MOT_OPEN_RPORT  PINB
@@ -140,4 +148,18 @@
 #define MOT_CLOSE_DDR   DDRB
 #define MOT_CLOSE_PWM   &OC1B
 
+// Button PLUS, connects to Vcc. Needs a pulldown, see BUTTONS in main.c.
+#define BUTTON_PLUS_PIN    PINA1
+#define BUTTON_PLUS_RPORT  PINA
+#define BUTTON_PLUS_WPORT  PORTA
+#define BUTTON_PLUS_DDR    DDRA
+#define BUTTON_PLUS_PWM    NULL
+
+// Button MINUS, same as PLUS. Button MENU isn't connected.
+#define BUTTON_MINUS_PIN   PINA0
+#define BUTTON_MINUS_RPORT PINA
+#define BUTTON_MINUS_WPORT PORTA
+#define BUTTON_MINUS_DDR   DDRA
+#define BUTTON_MINUS_PWM   NULL
+
 #endif /* _PINIO_H */
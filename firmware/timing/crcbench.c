@@ -0,0 +1,131 @@
+/** \file crcbench.c
+
+  Cycle counts of V-USB's usbCrc16Append(), which usbBuildTxBlock() runs
+  on every IN packet before it can be sent. Built once with the small and
+  once with the fast implementation in usbdrv/usbdrvasm.S, see
+  USB_USE_FAST_CRC in usbconfig.h.
+
+  Runs in simavr, which prints what we write to GPIOR0. Timer 1 runs at
+  the CPU clock and gets read around each call, so the numbers are exact
+  cycles, minus the cost of reading the timer.
+
+  "make crcbench" in the firmware directory builds and runs both variants
+  and also shows the size of usbdrvasm.o for each.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "avr_mcu_section.h"
+#include "usbdrv.h"
+
+AVR_MCU(F_CPU, BENCH_MCU);
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);
+
+
+/**
+  A packet's worth of data plus room for the CRC, like usbTxBuf.
+*/
+static uchar buffer[8 + 2];
+
+static void put_char(char c) {
+  GPIOR0 = c;
+}
+
+static void put_string(const char *s) {
+  while (*s)
+    put_char(*s++);
+}
+
+static void put_uint(uint16_t value) {
+  char digits[5];
+  uint8_t n = 0;
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (n)
+    put_char(digits[--n]);
+}
+
+/**
+  Cycles of one call, with the timer reads already subtracted.
+*/
+static uint16_t measure(uint8_t length, uint16_t overhead) {
+  uint16_t start, end;
+
+  start = TCNT1;
+  usbCrc16Append(buffer, length);
+  end = TCNT1;
+
+  return end - start - overhead;
+}
+
+/**
+  The benchmark doesn't talk USB, but usbdrv.o wants these.
+*/
+usbMsgLen_t usbFunctionSetup(uchar data[8]) {
+  return 0;
+}
+
+#ifdef SERIAL_NUMBER
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+  return 0;
+}
+#endif
+
+int main(void) {
+  uint16_t start, overhead;
+  uint8_t i;
+
+  cli();
+  TCCR1B = (1 << CS10);
+
+  for (i = 0; i < sizeof(buffer); i++)
+    buffer[i] = 0x5a ^ (i * 37);
+
+  start = TCNT1;
+  overhead = TCNT1 - start;
+
+  put_string("USB_USE_FAST_CRC ");
+  put_uint(USB_USE_FAST_CRC);
+  put_string(", usbCrc16Append() cycles by bytes:\n");
+  for (i = 0; i <= 8; i++) {
+    uint16_t cycles = measure(i, overhead);
+
+    put_uint(i);
+    put_char('\t');
+    put_uint(cycles);
+    if (i) {
+      put_char('\t');
+      put_uint(cycles / i);
+      put_string(" per byte");
+    }
+    put_char('\n');
+  }
+
+  // Sleeping with interrupts off ends the simulation.
+  sleep_enable();
+  sleep_cpu();
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+#
+# Worst case cycle counts of the interrupt handlers in firmware.lss.
+#
+# Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+#
+# This program is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, either version 3 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+#
+#
+# V-USB needs its interrupt, INT0, served within 25 cycles, see "Interrupt
+# latency" in usbdrv/usbdrv.h. Every other handler must therefore either
+# re-enable interrupts right away (ISR_NOBLOCK) or be done quickly.
+#
+# This walks each handler in the disassembly, following all branches and
+# calls, and sums up instruction cycles of the ATtiny2313 (AVRe core, 2 byte
+# program counter) along the longest path with interrupts disabled:
+# interrupt response (4), the vector's RJMP (2), everything up to and
+# including the instruction after SEI, or up to and including RETI, plus
+# the one main program instruction the CPU always executes after RETI (up
+# to 4).
+#
+# Once SEI took effect, cycles are no longer counted and loops are fine.
+# The rest of the handler still gets walked for CLI, though: each CLI opens
+# another window with interrupts disabled, counted the same way from the
+# CLI up to the next SEI or RETI, and checked against the same budget.
+# Loops and indirect jumps with interrupts disabled can't be bounded, nor
+# can a function returning with interrupts disabled to code that ran with
+# interrupts enabled; they're reported as errors. Each address is walked
+# once, so run time is linear in the size of the code, even with many
+# branches.
+#
+# Exit status is 1 if a handler keeps interrupts disabled for longer than
+# the budget, so the build fails.
+#
+# Usage: isr-cycles.py [--budget cycles] [--skip symbol ...] firmware.lss
+#
+
+import argparse
+import re
+import sys
+
+
+# Vector names of the ATtiny2313, for readable reports.
+VECTOR_NAMES = [
+  "RESET", "INT0", "INT1", "TIMER1_CAPT", "TIMER1_COMPA", "TIMER1_OVF",
+  "TIMER0_OVF", "USART_RX", "USART_UDRE", "USART_TX", "ANA_COMP", "PCINT",
+  "TIMER1_COMPB", "TIMER0_COMPA", "TIMER0_COMPB", "USI_START",
+  "USI_OVERFLOW", "EE_READY", "WDT_OVERFLOW"
+]
+
+# Interrupt response plus the RJMP in the vector table.
+ENTRY_CYCLES = 4 + 2
+# Worst main program instruction executed after RETI: RET.
+AFTER_RETI_CYCLES = 4
+
+# Cycles of instructions not taking 1 cycle. Branches and skips are handled
+# separately.
+CYCLES = {
+  "adiw": 2, "sbiw": 2, "cbi": 2, "sbi": 2,
+  "ld": 2, "ldd": 2, "lds": 2, "st": 2, "std": 2, "sts": 2,
+  "push": 2, "pop": 2, "lpm": 3, "elpm": 3, "spm": 4,
+  "rjmp": 2, "ijmp": 2, "jmp": 3,
+  "rcall": 3, "icall": 3, "call": 4,
+  "ret": 4, "reti": 4,
+}
+
+BRANCHES = {
+  "brbc", "brbs", "brcc", "brcs", "breq", "brge", "brhc", "brhs", "brid",
+  "brie", "brlo", "brlt", "brmi", "brne", "brpl", "brsh", "brtc", "brts",
+  "brvc", "brvs",
+}
+SKIPS = { "cpse", "sbrc", "sbrs", "sbic", "sbis" }
+
+LABEL = re.compile(r"^([0-9a-f]+) <([^>]+)>:\s*$")
+INSTRUCTION = re.compile(
+  r"^\s*([0-9a-f]+):\t((?:[0-9a-f]{2} )+)\s*\t(\S+)\s*([^;]*)(?:;\s*(.*))?$")
+TARGET = re.compile(r"0x([0-9a-f]+)")
+
+
+class AnalysisError(Exception):
+  pass
+
+
+class Instruction:
+  def __init__(self, address, size, mnemonic, operands, comment):
+    self.address = address
+    self.size = size
+    self.mnemonic = mnemonic
+    self.operands = operands.strip()
+    self.comment = comment or ""
+
+  def target(self):
+    # objdump puts absolute targets into the comment, e.g. "; 0x5c <...>".
+    match = TARGET.search(self.comment)
+    if not match:
+      match = TARGET.search(self.operands)
+    if not match:
+      raise AnalysisError("no target for %s at 0x%x" %
+                          (self.mnemonic, self.address))
+    return int(match.group(1), 16)
+
+
+def parse(path):
+  """Instructions by address and symbols by name from an avr-objdump
+     listing. Interleaved source lines are ignored."""
+  code = {}
+  symbols = {}
+
+  with open(path, errors = "replace") as f:
+    for line in f:
+      match = LABEL.match(line)
+      if match:
+        symbols[match.group(2)] = int(match.group(1), 16)
+        continue
+      match = INSTRUCTION.match(line)
+      if match:
+        address = int(match.group(1), 16)
+        size = len(match.group(2).split())
+        code[address] = Instruction(address, size, match.group(3),
+                                    match.group(4), match.group(5))
+  return code, symbols
+
+
+class Walker:
+  """Longest paths through a handler with interrupts disabled."""
+  def __init__(self, code):
+    self.code = code
+    # Results of blocked() by address. Walking stops when interrupts get
+    # enabled, so everything walked is with interrupts disabled.
+    self.done = {}
+    self.walking = set()
+
+  def cost(self, instruction, taken):
+    if instruction.mnemonic in BRANCHES:
+      return 2 if taken else 1
+    return CYCLES.get(instruction.mnemonic, 1)
+
+  def successors(self, instruction):
+    """(address, cycles, kind) for each way to continue after instruction.
+       kind is None, "call" or "return"."""
+    m = instruction.mnemonic
+    following = instruction.address + instruction.size
+
+    if m in ("ret", "reti"):
+      return [(None, self.cost(instruction, False), "return")]
+    if m in ("rjmp", "jmp"):
+      return [(instruction.target(), self.cost(instruction, False), None)]
+    if m in ("rcall", "call"):
+      return [(following, self.cost(instruction, False), "call")]
+    if m in ("ijmp", "icall", "eijmp", "eicall"):
+      raise AnalysisError("indirect jump at 0x%x" % instruction.address)
+    if m in BRANCHES:
+      return [(following, 1, None), (instruction.target(), 2, None)]
+    if m in SKIPS:
+      skipped = self.code.get(following)
+      if skipped is None:
+        raise AnalysisError("skip past the end at 0x%x" % instruction.address)
+      return [(following, 1, None),
+              (following + skipped.size, 1 + skipped.size // 2, None)]
+    return [(following, self.cost(instruction, False), None)]
+
+  def blocked(self, start):
+    """Worst case cycles from start until interrupts get enabled, and until
+       the RET with interrupts still disabled. Returns (enabled, returned,
+       resumes), None for a way not taken on any path, resumes the set of
+       addresses where code continues with interrupts enabled. A RETI counts
+       as enabling, the one instruction after it included."""
+    if start in self.done:
+      return self.done[start]
+    if start in self.walking:
+      raise AnalysisError("loop at 0x%x, can't bound it" % start)
+    self.walking.add(start)
+    try:
+      result = self.line(start)
+    finally:
+      self.walking.discard(start)
+
+    self.done[start] = result
+    return result
+
+  def line(self, start):
+    """blocked() of the straight line of code at start, recursing at the
+       first branch or call."""
+    address = start
+    seen = set()
+    spent = 0
+    while True:
+      instruction = self.code.get(address)
+      if instruction is None:
+        raise AnalysisError("no code at 0x%x" % address)
+      if address in seen or (address != start and address in self.walking):
+        raise AnalysisError("loop at 0x%x, can't bound it" % address)
+      seen.add(address)
+
+      ways = self.successors(instruction)
+      if len(ways) > 1:
+        return worst(*(later(spent + cycles, self.blocked(next_address))
+                       for (next_address, cycles, _) in ways))
+
+      (next_address, cycles, kind) = ways[0]
+      spent += cycles
+      if kind == "call":
+        (enabled, returned, resumes) = self.blocked(instruction.target())
+        if enabled is not None:
+          # Enabled in there, so maybe still enabled after returning.
+          resumes = resumes | {next_address}
+        result = later(spent, (enabled, None, resumes))
+        if returned is not None:
+          result = worst(result, later(spent + returned,
+                                       self.blocked(next_address)))
+        return result
+      if instruction.mnemonic == "sei":
+        # SEI takes effect after the next instruction.
+        following = self.code.get(address + instruction.size)
+        return (spent + (following and
+                         max(c for (_, c, _) in self.successors(following))
+                         or 0), None, frozenset({next_address}))
+      if instruction.mnemonic == "reti":
+        return (spent + AFTER_RETI_CYCLES, None, frozenset())
+      if kind == "return":
+        return (None, spent, frozenset())
+      address = next_address
+
+  def windows(self, resumes):
+    """Worst case cycles of the windows opened by CLI in code running with
+       interrupts enabled, starting at the addresses in resumes, 0 if there
+       are none."""
+    todo = list(resumes)
+    seen = set()
+    longest = 0
+    while todo:
+      address = todo.pop()
+      if address in seen:
+        continue
+      seen.add(address)
+      instruction = self.code.get(address)
+      if instruction is None:
+        raise AnalysisError("no code at 0x%x" % address)
+
+      if instruction.mnemonic == "cli":
+        following = address + instruction.size
+        (enabled, returned, more) = self.blocked(following)
+        if returned is not None:
+          raise AnalysisError("CLI at 0x%x returns with interrupts disabled, "
+                              "can't follow" % address)
+        longest = max(longest, self.cost(instruction, False) + enabled)
+        todo.extend(more)
+        continue
+
+      for (next_address, _, kind) in self.successors(instruction):
+        if kind == "call":
+          todo.append(instruction.target())
+        if next_address is not None:
+          todo.append(next_address)
+    return longest
+
+
+def later(cycles, result):
+  """result of blocked(), cycles later."""
+  return tuple(None if r is None else cycles + r for r in result[:2]) + \
+         (result[2],)
+
+
+def worst(*results):
+  """The worse of results of blocked(), for each way."""
+  return tuple(max((r for r in ways if r is not None), default = None)
+               for ways in list(zip(*results))[:2]) + \
+         (frozenset().union(*(r[2] for r in results)),)
+
+
+def main():
+  parser = argparse.ArgumentParser(
+    description = "Worst case cycle counts of interrupt handlers.")
+  parser.add_argument("--budget", type = int, default = 25,
+                      help = "Cycles a handler may keep interrupts "
+                             "disabled, default 25.")
+  parser.add_argument("--skip", action = "append", default = [],
+                      help = "Handler not to check, e.g. V-USB's own.")
+  parser.add_argument("listing", help = "avr-objdump -d or -S output.")
+  args = parser.parse_args()
+
+  code, symbols = parse(args.listing)
+  # blocked() recurses once per branch along a path.
+  sys.setrecursionlimit(max(sys.getrecursionlimit(), 4 * len(code)))
+  walker = Walker(code)
+  failed = False
+
+  handlers = sorted((address, name) for (name, address) in symbols.items()
+                    if re.match(r"^__vector_\d+$", name))
+  if not handlers:
+    print("isr-cycles: no interrupt handlers found in %s." % args.listing)
+
+  for (address, name) in handlers:
+    number = int(name.split("_")[-1])
+    vector = VECTOR_NAMES[number] if number < len(VECTOR_NAMES) else "?"
+    if name in args.skip:
+      print("%-12s %-12s skipped" % (name, vector))
+      continue
+    try:
+      (enabled, returned, resumes) = walker.blocked(address)
+      entry = ENTRY_CYCLES + max(c for c in (enabled, returned)
+                                 if c is not None)
+      window = walker.windows(resumes)
+    except AnalysisError as error:
+      print("%-12s %-12s ERROR: %s" % (name, vector, error))
+      failed = True
+      continue
+
+    verdict = "ok"
+    if max(entry, window) > args.budget:
+      verdict = "OVER BUDGET of %d" % args.budget
+      failed = True
+    print("%-12s %-12s %4d cycles interrupts disabled on entry, %4d after "
+          "CLI, %s" % (name, vector, entry, window, verdict))
+
+  return 1 if failed else 0
+
+
+if __name__ == "__main__":
+  sys.exit(main())
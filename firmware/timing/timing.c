@@ -0,0 +1,633 @@
+/** \file timing.c
+
+  Timing profile of the firmware, measured by running the real firmware.elf
+  in simavr, an instruction level AVR emulator.
+
+  The harness plays USB host: it sends keep-alive EOPs every millisecond and
+  every few milliseconds a complete control transfer, a 'c' request like
+  terminal.py sends, retrying the IN token until the firmware answers. It
+  also plays the analog side of a temperature measurement: when one of the
+  TEMP_x pins starts charging the capacitor, the comparator input rises
+  above the reference a given number of Timer 1 ticks later.
+
+  Measured are:
+
+    - Entry latency of each interrupt we raise, from the edge to the vector.
+      That's the time ISR(ANA_COMP_vect) waits behind the V-USB handler and
+      the time INT0 waits behind everybody else.
+    - Duration of each interrupt handler, vector to RETI.
+    - Interval between usbPoll() calls.
+    - Main loop period, the interval between calls of a marker function,
+      temp_measure() by default.
+
+  Each is printed as a histogram in cycles, with power-of-two buckets.
+
+  Limitations: simavr applies our line changes between instructions, so edges
+  are off by up to 3 cycles. V-USB resynchronises on every edge, like it has
+  to on a real bus. OSCCAL has no effect, so osctune.h just runs idle.
+
+  Build and run with "make timing" in the firmware directory. Needs simavr
+  and libelf, e.g. "sudo apt-get install libsimavr-dev libelf-dev".
+
+  Usage: timing [-f F_CPU] [-t seconds] [-u ms] [-c counts] [-l symbol] elf
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <gelf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_acomp.h>
+
+
+/** \def VECTORS
+  Interrupt vectors of the ATtiny2313, 2 bytes each.
+*/
+#define VECTORS         19
+#define VECTOR_INT0     1
+#define VECTOR_ANA_COMP 10
+
+/** \def OPCODE_RETI
+  What the handler ends with.
+*/
+#define OPCODE_RETI     0x9518
+
+/** \def DMINUS, DPLUS
+  USB lines, see USB_CFG_DMINUS_BIT and USB_CFG_DPLUS_BIT in usbconfig.h.
+*/
+#define DMINUS          2
+#define DPLUS           1
+
+/** \def TEMP_FIRST, TEMP_LAST
+  Port D pins charging the capacitor, TEMP_C to TEMP_R in pinio.h.
+*/
+#define TEMP_FIRST      3
+#define TEMP_LAST       5
+
+/** \def REFERENCE_MV
+  Voltage of the R10/R11 divider, the comparator's reference.
+*/
+#define REFERENCE_MV    1060
+
+/** \def USB_START_MS
+  main() keeps USB disconnected for 300 ms, start talking after that.
+*/
+#define USB_START_MS    400
+
+/** \def BUCKETS
+  Histogram buckets, powers of two of cycles.
+*/
+#define BUCKETS         32
+
+
+typedef struct {
+  const char *name;
+  uint64_t count, sum, min, max;
+  uint64_t bucket[BUCKETS];
+} histogram_t;
+
+/// Line states, in order of the bits D- and D+.
+enum { SE0 = 0, K = 1, J = 2 };
+
+typedef struct {
+  avr_cycle_count_t cycle;
+  uint8_t state;
+} line_event_t;
+
+static avr_t *avr;
+static uint32_t f_cpu = 12800000;
+static double bit_cycles;
+
+static avr_irq_t *pin_dminus, *pin_dplus, *ain0, *ain1;
+
+/// Line changes still to be played, in order of time.
+static line_event_t events[2048];
+static unsigned events_head, events_tail;
+static uint8_t line_state = J;
+static int driving;
+
+/// Device transmissions, for telling a NAK from data.
+static avr_cycle_count_t device_first, device_last;
+
+/// USB host state.
+static enum { IDLE, SETUP_SENT, IN_SENT } host_state;
+static unsigned transfer_interval_ms = 10, ms;
+static uint64_t transfers, naks;
+
+/// Comparator model.
+static uint32_t count_ticks = 5800;
+static uint8_t charging;
+
+/// Interrupts raised by us and not entered, yet.
+static avr_cycle_count_t raised[VECTORS];
+
+/// Handlers running, innermost last.
+static struct {
+  int vector;
+  avr_cycle_count_t entry;
+} active[8];
+static int active_depth, int0_active;
+
+/// Addresses of interesting functions, byte addresses like avr->pc.
+static uint32_t address_usbpoll, address_marker;
+static avr_cycle_count_t last_usbpoll, last_marker;
+
+static histogram_t latency[VECTORS], duration[VECTORS];
+static histogram_t usbpoll = { "usbPoll() interval" };
+static histogram_t main_loop = { "main loop period" };
+
+
+static void usage(const char *name) {
+
+  fprintf(stderr,
+    "Usage: %s [-f F_CPU] [-t seconds] [-u ms] [-c counts] [-l symbol] elf\n"
+    "\n"
+    "  -f  Clock frequency, default %lu.\n"
+    "  -t  Simulated time, default 5 seconds.\n"
+    "  -u  A control transfer every this many milliseconds, default %u.\n"
+    "  -c  Timer 1 ticks until the comparator triggers, default %lu.\n"
+    "  -l  Function marking the main loop period, default temp_measure.\n",
+    name, (unsigned long)f_cpu, transfer_interval_ms,
+    (unsigned long)count_ticks);
+}
+
+/* ---- Statistics -------------------------------------------------------- */
+
+static void histogram_add(histogram_t *h, uint64_t value) {
+  int bucket = 0;
+
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  h->count++;
+  h->sum += value;
+
+  while (bucket < BUCKETS - 1 && value >= (2ULL << bucket))
+    bucket++;
+  h->bucket[bucket]++;
+}
+
+static void histogram_print(const histogram_t *h) {
+  uint64_t most = 0;
+  int i;
+
+  if (h->count == 0)
+    return;
+
+  printf("%s: %llu samples, min %llu, mean %llu, max %llu cycles "
+         "(%.1f us)\n", h->name, (unsigned long long)h->count,
+         (unsigned long long)h->min,
+         (unsigned long long)(h->sum / h->count),
+         (unsigned long long)h->max, h->max * 1e6 / f_cpu);
+
+  for (i = 0; i < BUCKETS; i++)
+    if (h->bucket[i] > most)
+      most = h->bucket[i];
+  for (i = 0; i < BUCKETS; i++)
+    if (h->bucket[i])
+      printf("  %10llu..%-10llu %8llu %.*s\n",
+             i ? 1ULL << i : 0ULL, (2ULL << i) - 1,
+             (unsigned long long)h->bucket[i],
+             (int)(h->bucket[i] * 40 / most + 1),
+             "#########################################");
+  printf("\n");
+}
+
+/* ---- USB host ---------------------------------------------------------- */
+
+/**
+  Set the lines. A rising D- raises INT0, unless the V-USB handler is
+  already busy with the packet.
+*/
+static void line_set(uint8_t state) {
+
+  if (state == J && line_state != J && ! raised[VECTOR_INT0] &&
+      ! int0_active)
+    raised[VECTOR_INT0] = avr->cycle;
+  line_state = state;
+  driving = 1;
+  avr_raise_irq(pin_dminus, state == J);
+  avr_raise_irq(pin_dplus, state == K);
+  driving = 0;
+}
+
+static avr_cycle_count_t line_timer(avr_t *avr, avr_cycle_count_t when,
+                                    void *param) {
+
+  while (events_tail != events_head && events[events_tail].cycle <= when) {
+    line_set(events[events_tail].state);
+    events_tail = (events_tail + 1) % (sizeof(events) / sizeof(events[0]));
+  }
+
+  return events_tail != events_head ? events[events_tail].cycle : 0;
+}
+
+/**
+  Queue line states, one per bit time, starting at cycle start.
+*/
+static avr_cycle_count_t line_queue(avr_cycle_count_t start,
+                                    const uint8_t *states, int n) {
+  int idle = events_tail == events_head;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    events[events_head].cycle = start + (avr_cycle_count_t)(i * bit_cycles);
+    events[events_head].state = states[i];
+    events_head = (events_head + 1) % (sizeof(events) / sizeof(events[0]));
+  }
+  if (idle && n)
+    avr_cycle_timer_register(avr, events[events_tail].cycle - avr->cycle,
+                             line_timer, NULL);
+
+  return start + (avr_cycle_count_t)(n * bit_cycles);
+}
+
+static uint8_t crc5(uint16_t data) {
+  uint8_t crc = 0x1F;
+  int i;
+
+  for (i = 0; i < 11; i++, data >>= 1)
+    crc = ((crc ^ data) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+
+  return crc ^ 0x1F;
+}
+
+static uint16_t crc16(const uint8_t *data, int n) {
+  uint16_t crc = 0xFFFF;
+  int i;
+
+  while (n--) {
+    crc ^= *data++;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+
+  return crc ^ 0xFFFF;
+}
+
+/**
+  Queue a packet: SYNC, the bytes given, EOP. Bytes go out LSB first, with
+  bit stuffing and NRZI encoding.
+*/
+static avr_cycle_count_t packet(avr_cycle_count_t start,
+                                const uint8_t *bytes, int n) {
+  uint8_t states[8 + 8 * 12 + 8 * 12 / 6 + 3];
+  uint8_t level = J;
+  int count = 0, ones = 0, i, bit;
+
+  for (i = -1; i < n; i++) {
+    uint8_t byte = i < 0 ? 0x80 : bytes[i]; // SYNC first.
+
+    for (bit = 0; bit < 8; bit++, byte >>= 1) {
+      if (byte & 1) {
+        states[count++] = level;
+        if (++ones == 6) {
+          level = level == J ? K : J;
+          states[count++] = level;
+          ones = 0;
+        }
+      } else {
+        level = level == J ? K : J;
+        states[count++] = level;
+        ones = 0;
+      }
+    }
+  }
+  states[count++] = SE0;
+  states[count++] = SE0;
+  states[count++] = J;
+
+  return line_queue(start, states, count);
+}
+
+static avr_cycle_count_t token(avr_cycle_count_t start, uint8_t pid) {
+  uint8_t bytes[3];
+  uint16_t address = 0; // Address 0, endpoint 0.
+
+  bytes[0] = pid;
+  address |= crc5(address) << 11;
+  bytes[1] = address;
+  bytes[2] = address >> 8;
+
+  return packet(start, bytes, 3);
+}
+
+static avr_cycle_count_t data(avr_cycle_count_t start, uint8_t pid,
+                              const uint8_t *payload, int n) {
+  uint8_t bytes[1 + 8 + 2];
+  uint16_t crc = crc16(payload, n);
+
+  bytes[0] = pid;
+  memcpy(bytes + 1, payload, n);
+  bytes[1 + n] = crc;
+  bytes[2 + n] = crc >> 8;
+
+  return packet(start, bytes, n + 3);
+}
+
+static avr_cycle_count_t us(double microseconds) {
+  return (avr_cycle_count_t)(microseconds * f_cpu / 1e6);
+}
+
+/**
+  What a bus with a single low speed device sees every millisecond: a keep
+  alive EOP, then transfer traffic.
+*/
+static avr_cycle_count_t frame_timer(avr_t *avr, avr_cycle_count_t when,
+                                     void *param) {
+  static const uint8_t keep_alive[] = { SE0, SE0, J };
+  static const uint8_t setup[] = { 0xC0, 'c', 0, 0, 0, 0, 8, 0 };
+  static const uint8_t ack[] = { 0xD2 };
+  avr_cycle_count_t t = when;
+
+  t = line_queue(t, keep_alive, sizeof(keep_alive));
+  ms++;
+
+  if (host_state == IN_SENT) {
+    // More than a NAK (16 bits) coming back means data.
+    if (device_last - device_first > 30 * bit_cycles) {
+      t = packet(t + us(10), ack, sizeof(ack));
+      t = token(t + us(20), 0xE1);                                 // OUT
+      t = data(t + us(2), 0x4B, setup, 0);                         // DATA1
+      transfers++;
+      host_state = IDLE;
+    } else {
+      naks++;
+      host_state = SETUP_SENT;
+    }
+  } else if (host_state == IDLE && ms % transfer_interval_ms == 0) {
+    t = token(t + us(10), 0x2D);                                   // SETUP
+    data(t + us(2), 0xC3, setup, sizeof(setup));                   // DATA0
+    host_state = SETUP_SENT;
+    return when + us(1000);
+  }
+
+  if (host_state == SETUP_SENT) {
+    device_first = device_last = 0;
+    token(t + us(10), 0x69);                                       // IN
+    host_state = IN_SENT;
+  }
+
+  return when + us(1000);
+}
+
+/* ---- Pins and the analog side ------------------------------------------ */
+
+static avr_cycle_count_t comparator_timer(avr_t *avr,
+                                          avr_cycle_count_t when,
+                                          void *param) {
+
+  if (charging) {
+    raised[VECTOR_ANA_COMP] = avr->cycle;
+    avr_raise_irq(ain0, 3300);
+  }
+
+  return 0;
+}
+
+/**
+  Port D changes, ours and the firmware's.
+*/
+static void port_d_changed(avr_irq_t *irq, uint32_t value, void *param) {
+  int pin = (intptr_t)param;
+
+  if (pin == DMINUS || pin == DPLUS) {
+    if ( ! driving) {
+      if ( ! device_first)
+        device_first = avr->cycle;
+      device_last = avr->cycle;
+    }
+  } else if (pin >= TEMP_FIRST && pin <= TEMP_LAST) {
+    uint8_t mask = 1 << pin;
+
+    if (value && ! charging)
+      avr_cycle_timer_register(avr, (avr_cycle_count_t)count_ticks * 8,
+                               comparator_timer, NULL);
+    charging = value ? charging | mask : charging & ~mask;
+    if ( ! charging)
+      avr_raise_irq(ain0, 0);
+  }
+}
+
+/* ---- Symbols ----------------------------------------------------------- */
+
+/**
+  Byte address of a function in the ELF, 0 if there's no such symbol, e.g.
+  because it got inlined.
+*/
+static uint32_t symbol_address(const char *file, const char *name) {
+  Elf *elf;
+  Elf_Scn *section = NULL;
+  uint32_t address = 0;
+  int fd;
+
+  elf_version(EV_CURRENT);
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  elf = elf_begin(fd, ELF_C_READ, NULL);
+
+  while (elf && (section = elf_nextscn(elf, section)) && ! address) {
+    GElf_Shdr header;
+    Elf_Data *symbols;
+    size_t i;
+
+    gelf_getshdr(section, &header);
+    if (header.sh_type != SHT_SYMTAB)
+      continue;
+    symbols = elf_getdata(section, NULL);
+    for (i = 0; symbols && i < header.sh_size / header.sh_entsize; i++) {
+      GElf_Sym symbol;
+
+      gelf_getsym(symbols, i, &symbol);
+      if (GELF_ST_TYPE(symbol.st_info) == STT_FUNC &&
+          ! strcmp(elf_strptr(elf, header.sh_link, symbol.st_name), name))
+        address = symbol.st_value;
+    }
+  }
+
+  if (elf)
+    elf_end(elf);
+  close(fd);
+
+  return address;
+}
+
+/* ---- Main -------------------------------------------------------------- */
+
+/**
+  Look at where the CPU went with the last instruction.
+*/
+static void observe(uint16_t opcode) {
+  uint32_t pc = avr->pc;
+
+  if (opcode == OPCODE_RETI && active_depth) {
+    active_depth--;
+    histogram_add(&duration[active[active_depth].vector],
+                  avr->cycle - active[active_depth].entry);
+    if (active[active_depth].vector == VECTOR_INT0) {
+      int0_active = 0;
+      raised[VECTOR_INT0] = 0; // Edges of the packet just handled.
+    }
+  }
+
+  if (pc && pc < VECTORS * 2) {
+    int vector = pc / 2;
+
+    if (raised[vector]) {
+      histogram_add(&latency[vector], avr->cycle - raised[vector]);
+      raised[vector] = 0;
+    }
+    if (active_depth < (int)(sizeof(active) / sizeof(active[0]))) {
+      active[active_depth].vector = vector;
+      active[active_depth].entry = avr->cycle;
+      active_depth++;
+    }
+    if (vector == VECTOR_INT0)
+      int0_active = 1;
+  }
+
+  if (pc == address_usbpoll) {
+    if (last_usbpoll)
+      histogram_add(&usbpoll, avr->cycle - last_usbpoll);
+    last_usbpoll = avr->cycle;
+  }
+  if (pc == address_marker) {
+    if (last_marker)
+      histogram_add(&main_loop, avr->cycle - last_marker);
+    last_marker = avr->cycle;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static const char *names[VECTORS] = {
+    "RESET", "INT0", "INT1", "TIMER1_CAPT", "TIMER1_COMPA", "TIMER1_OVF",
+    "TIMER0_OVF", "USART_RX", "USART_UDRE", "USART_TX", "ANA_COMP", "PCINT",
+    "TIMER1_COMPB", "TIMER0_COMPA", "TIMER0_COMPB", "USI_START",
+    "USI_OVERFLOW", "EE_READY", "WDT_OVERFLOW"
+  };
+  static char latency_names[VECTORS][40], duration_names[VECTORS][40];
+  const char *marker = "temp_measure";
+  elf_firmware_t firmware;
+  avr_cycle_count_t end;
+  double seconds = 5.;
+  int option, i, state;
+
+  while ((option = getopt(argc, argv, "f:t:u:c:l:h")) != -1) {
+    switch (option) {
+      case 'f': f_cpu = strtoul(optarg, NULL, 10); break;
+      case 't': seconds = strtod(optarg, NULL); break;
+      case 'u': transfer_interval_ms = strtoul(optarg, NULL, 10); break;
+      case 'c': count_ticks = strtoul(optarg, NULL, 10); break;
+      case 'l': marker = optarg; break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind + 1 != argc || ! f_cpu || ! transfer_interval_ms) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[optind], &firmware)) {
+    fprintf(stderr, "Can't read %s.\n", argv[optind]);
+    return 1;
+  }
+  avr = avr_make_mcu_by_name("attiny2313");
+  if ( ! avr) {
+    fprintf(stderr, "This simavr doesn't know the ATtiny2313.\n");
+    return 1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = f_cpu;
+  bit_cycles = f_cpu / 1.5e6;
+
+  address_usbpoll = symbol_address(argv[optind], "usbPoll");
+  address_marker = symbol_address(argv[optind], marker);
+  if ( ! address_marker)
+    fprintf(stderr, "No function %s, got it inlined? No main loop "
+                    "period measured.\n", marker);
+
+  for (i = 0; i < VECTORS; i++) {
+    snprintf(latency_names[i], sizeof(latency_names[i]), "%s latency",
+             names[i]);
+    snprintf(duration_names[i], sizeof(duration_names[i]), "%s duration",
+             names[i]);
+    latency[i].name = latency_names[i];
+    duration[i].name = duration_names[i];
+  }
+
+  pin_dminus = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), DMINUS);
+  pin_dplus = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), DPLUS);
+  for (i = DPLUS; i <= TEMP_LAST; i++) {
+    avr_irq_t *pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), i);
+
+    avr_irq_register_notify(pin, port_d_changed, (void *)(intptr_t)i);
+  }
+
+  ain0 = avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN0);
+  ain1 = avr_io_getirq(avr, AVR_IOCTL_ACOMP_GETIRQ, ACOMP_IRQ_AIN1);
+  if ( ! ain0 || ! ain1) {
+    fprintf(stderr, "This simavr has no comparator for the ATtiny2313.\n");
+    return 1;
+  }
+  avr_raise_irq(ain1, REFERENCE_MV);
+  avr_raise_irq(ain0, 0);
+
+  line_set(J);
+  raised[VECTOR_INT0] = 0;
+  avr_cycle_timer_register(avr, us(USB_START_MS * 1000.), frame_timer, NULL);
+
+  end = (avr_cycle_count_t)(seconds * f_cpu);
+  do {
+    // What's about to execute, unless the CPU sleeps.
+    uint16_t opcode = avr->state != cpu_Running ? 0 :
+                      avr->flash[avr->pc] | avr->flash[avr->pc + 1] << 8;
+
+    state = avr_run(avr);
+    observe(opcode);
+  } while (avr->cycle < end && state != cpu_Done && state != cpu_Crashed);
+
+  if (state == cpu_Crashed)
+    printf("Firmware crashed at 0x%04x.\n\n", avr->pc);
+  printf("%.1f s simulated at %lu Hz, %llu control transfers, %llu NAKs.\n\n",
+         seconds, (unsigned long)f_cpu, (unsigned long long)transfers,
+         (unsigned long long)naks);
+
+  for (i = 1; i < VECTORS; i++) {
+    histogram_print(&latency[i]);
+    histogram_print(&duration[i]);
+  }
+  histogram_print(&usbpoll);
+  histogram_print(&main_loop);
+
+  return state == cpu_Crashed;
+}
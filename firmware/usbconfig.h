@@ -167,6 +167,12 @@ section at the end of this file).
  * proceed, do a return after doing your things. One possible application
  * (besides debugging) is to flash a status LED on each packet.
  */
+#if defined HEALTH || defined OSCCAL_CACHE
+  #ifndef __ASSEMBLER__
+    extern void usb_reset(void);
+  #endif
+  #define USB_RESET_HOOK(resetStarts)   if ( ! resetStarts) usb_reset();
+#endif
 /* #define USB_RESET_HOOK(resetStarts)     if(!resetStarts){hadUsbReset();} */
 /* This macro is a hook if you need to know when an USB RESET occurs. It has
  * one parameter which distinguishes between the start of RESET state and its
@@ -176,7 +182,11 @@ section at the end of this file).
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
-#define USB_COUNT_SOF                   0
+#if defined SOF_SYNC || defined SLEEP
+  #define USB_COUNT_SOF                 1
+#else
+  #define USB_COUNT_SOF                 0
+#endif
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
@@ -212,13 +222,22 @@ section at the end of this file).
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
  * compiled in. This function can be used to calibrate the AVR's RC oscillator.
  */
-#define USB_USE_FAST_CRC                0
+#ifndef USB_USE_FAST_CRC
+  #if defined(__AVR_ATtiny4313__)
+    #define USB_USE_FAST_CRC            1
+  #else
+    #define USB_USE_FAST_CRC            0
+  #endif
+#endif
 /* The assembler module has two implementations for the CRC algorithm. One is
  * faster, the other is smaller. This CRC routine is only used for transmitted
  * messages where timing is not critical. The faster routine needs 31 cycles
  * per byte while the smaller one needs 61 to 69 cycles. The faster routine
  * may be worth the 32 bytes bigger code size if you transmit lots of data and
  * run the AVR close to its limit.
+ * Measure with "make crcbench". The ATtiny2313 can't spare the Flash, the
+ * ATtiny4313 can, so it gets the fast one. A faster F_CPU shrinks both
+ * variants alike. Override with -DUSB_USE_FAST_CRC=x in FEATURES.
  */
 
 /* -------------------------- Device Description --------------------------- */
@@ -355,7 +374,13 @@ section at the end of this file).
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
 #define USB_CFG_DESCR_PROPS_STRING_PRODUCT          0
-#define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER    0
+#ifdef SERIAL_NUMBER
+  /* Serial number comes from EEPROM, see serial_init() in main.c. */
+  #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER  (USB_PROP_IS_DYNAMIC | \
+                                                     USB_PROP_IS_RAM)
+#else
+  #define USB_CFG_DESCR_PROPS_STRING_SERIAL_NUMBER  0
+#endif
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
@@ -0,0 +1,232 @@
+/** \file fleet.cpp
+
+  All ISTAtrol units attached to the host. See fleet.h.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "fleet.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "protocol.h"
+
+
+namespace istatrol {
+
+Fleet::~Fleet() {
+
+  if (have_hotplug_)
+    libusb_hotplug_deregister_callback(context_, hotplug_handle_);
+  for (libusb_device *device : arrived_)
+    libusb_unref_device(device);
+  while ( ! units_.empty())
+    drop(units_.begin());
+}
+
+int Fleet::run(unsigned interval, volatile sig_atomic_t &quit) {
+  uint64_t next, rescan = 0;
+  int result;
+
+  have_hotplug_ = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+    libusb_hotplug_register_callback(context_,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_NO_FLAGS, kVendorId, kProductId,
+      LIBUSB_HOTPLUG_MATCH_ANY, hotplug, this, &hotplug_handle_)
+    == LIBUSB_SUCCESS;
+  if ( ! have_hotplug_)
+    fprintf(stderr, "No hotplug support, searching every %u ms.\n",
+            kRescanMs);
+
+  next = monotonic_ms();
+  while ( ! quit) {
+    uint64_t now = monotonic_ms(), wake;
+    std::vector<libusb_device *> devices;
+    struct timeval tv;
+
+    // Swap first, closing units below runs the event loop, which may call
+    // hotplug() again.
+    devices.swap(left_);
+    for (libusb_device *device : devices) {
+      Units::iterator it = units_.find(device);
+
+      if (it != units_.end()) {
+        if ( ! it->second->failed())
+          lost(*it->second);
+        drop(it);
+      }
+    }
+    devices.clear();
+    devices.swap(arrived_);
+    for (libusb_device *device : devices) {
+      if (units_.find(device) == units_.end())
+        add(device);
+      libusb_unref_device(device);
+    }
+
+    // Units which failed without hotplug noticing get searched for, too.
+    devices.clear();
+    for (auto &unit : units_)
+      if (unit.second->failed())
+        devices.push_back(unit.first);
+    for (libusb_device *device : devices) {
+      Units::iterator it = units_.find(device);
+
+      if (it != units_.end())
+        drop(it);
+    }
+    if (now >= rescan) {
+      scan();
+      rescan = now + (have_hotplug_ ? interval : kRescanMs);
+    }
+
+    if (now >= next) {
+      for (auto &unit : units_)
+        enqueue(*unit.second);
+
+      next += interval;
+      if (next <= now) // We were suspended or similar, don't catch up.
+        next = now + interval;
+    }
+
+    wake = std::min(next, rescan);
+    tv.tv_sec = (wake - now) / 1000;
+    tv.tv_usec = (wake - now) % 1000 * 1000;
+    result = libusb_handle_events_timeout_completed(context_, &tv, nullptr);
+    if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "libusb: %s\n", libusb_strerror(result));
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+void Fleet::attached(Unit &unit) {
+  std::map<std::string, uint64_t>::iterator it = lost_.find(unit.id());
+
+  if (it != lost_.end()) {
+    char text[48];
+
+    snprintf(text, sizeof(text), "attached after %llu ms",
+             (unsigned long long)(monotonic_ms() - it->second));
+    output_.note(unit.id(), realtime_ms(), text);
+    lost_.erase(it);
+  } else {
+    output_.note(unit.id(), realtime_ms(), "attached");
+  }
+}
+
+void Fleet::lost(Unit &unit) {
+
+  // The first failure is the moment the unit is considered gone.
+  if (lost_.emplace(unit.id(), monotonic_ms()).second)
+    output_.note(unit.id(), realtime_ms(), "detached");
+}
+
+void Fleet::transfer_done(Unit &unit) {
+  Bus &bus = buses_[unit.bus()];
+
+  bus.in_flight--;
+  dispatch(bus);
+}
+
+int LIBUSB_CALL Fleet::hotplug(libusb_context *, libusb_device *device,
+                               libusb_hotplug_event event, void *user_data) {
+  Fleet *fleet = static_cast<Fleet *>(user_data);
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+    fleet->arrived_.push_back(libusb_ref_device(device));
+  else
+    fleet->left_.push_back(device);
+
+  return 0; // Keep this callback registered.
+}
+
+/**
+  Open all ISTAtrols on the bus we don't know about, yet.
+*/
+void Fleet::scan() {
+  libusb_device **list;
+  ssize_t n = libusb_get_device_list(context_, &list);
+
+  for (ssize_t i = 0; i < n; i++) {
+    struct libusb_device_descriptor descriptor;
+
+    if (libusb_get_device_descriptor(list[i], &descriptor) == 0 &&
+        descriptor.idVendor == kVendorId &&
+        descriptor.idProduct == kProductId &&
+        units_.find(list[i]) == units_.end())
+      add(list[i]);
+  }
+  if (n >= 0)
+    libusb_free_device_list(list, 1);
+}
+
+/**
+  Open a new unit and ask for its first request right away, so sampling of a
+  re-attached unit resumes without waiting for the next interval.
+*/
+void Fleet::add(libusb_device *device) {
+  std::unique_ptr<Unit> unit(new Unit(*this, output_));
+
+  if (unit->open(device)) {
+    Unit &u = *unit;
+
+    units_[device] = std::move(unit);
+    enqueue(u);
+  }
+}
+
+void Fleet::drop(Units::iterator it) {
+  std::unique_ptr<Unit> unit = std::move(it->second);
+
+  units_.erase(it);
+  if (unit->queued) {
+    std::deque<Unit *> &waiting = buses_[unit->bus()].waiting;
+
+    waiting.erase(std::find(waiting.begin(), waiting.end(), unit.get()));
+    unit->queued = false;
+  }
+  unit->close(); // Runs the event loop if a transfer is still underway.
+}
+
+void Fleet::enqueue(Unit &unit) {
+  Bus &bus = buses_[unit.bus()];
+
+  if (unit.queued || ! unit.is_open() || unit.failed())
+    return;
+
+  bus.waiting.push_back(&unit);
+  unit.queued = true;
+  dispatch(bus);
+}
+
+void Fleet::dispatch(Bus &bus) {
+
+  while (bus.in_flight < max_in_flight_ && ! bus.waiting.empty()) {
+    Unit *unit = bus.waiting.front();
+
+    bus.waiting.pop_front();
+    unit->queued = false;
+    if (unit->submit())
+      bus.in_flight++;
+  }
+}
+
+} // namespace istatrol
@@ -0,0 +1,114 @@
+/** \file fleet.h
+
+  All ISTAtrol units attached to the host, served by one libusb event loop.
+
+  Samples are requested from all units at once at each interval. Units are
+  queued per USB bus and only a bounded number of transfers is in flight on
+  each bus at any time. A unit which is slow to answer occupies one of these
+  slots until its transfer completes or times out, the others keep going.
+  A unit which still has a request underway when the next interval comes
+  simply skips that sample.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _FLEET_H
+#define _FLEET_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <libusb-1.0/libusb.h>
+
+#include "output.h"
+#include "unit.h"
+
+
+namespace istatrol {
+
+/// Default for the number of transfers in flight per bus.
+constexpr unsigned kMaxInFlightDefault = 4;
+
+/// Search interval for missing units if there's no hotplug support.
+constexpr unsigned kRescanMs = 1000;
+
+class Fleet {
+ public:
+  Fleet(libusb_context *context, Output &output, unsigned max_in_flight)
+    : context_(context), output_(output), max_in_flight_(max_in_flight) {}
+  ~Fleet();
+
+  Fleet(const Fleet &) = delete;
+  Fleet &operator=(const Fleet &) = delete;
+
+  libusb_context *context() const { return context_; }
+
+  /**
+    Sample all units every interval milliseconds until quit becomes true.
+    Returns 0 on a regular quit, 1 on a fatal libusb error.
+  */
+  int run(unsigned interval, volatile sig_atomic_t &quit);
+
+  /// A unit is ready, its name is final.
+  void attached(Unit &unit);
+  /// A unit went away or failed, to be closed by the event loop.
+  void lost(Unit &unit);
+  /// A transfer of this unit completed, its slot on the bus is free again.
+  void transfer_done(Unit &unit);
+
+ private:
+  struct Bus {
+    unsigned in_flight = 0;
+    std::deque<Unit *> waiting;
+  };
+  typedef std::map<libusb_device *, std::unique_ptr<Unit>> Units;
+
+  static int LIBUSB_CALL hotplug(libusb_context *context,
+                                 libusb_device *device,
+                                 libusb_hotplug_event event, void *user_data);
+  void scan();
+  void add(libusb_device *device);
+  void drop(Units::iterator it);
+  void enqueue(Unit &unit);
+  void dispatch(Bus &bus);
+
+  libusb_context *context_;
+  Output &output_;
+  unsigned max_in_flight_;
+  Units units_;
+  std::map<uint8_t, Bus> buses_;
+  /// When units went away, by name, to report the gap on re-attach.
+  std::map<std::string, uint64_t> lost_;
+
+  /**
+    What hotplug told us. Handled in the event loop, because libusb doesn't
+    allow opening or closing devices from within hotplug callbacks. Arrived
+    devices are referenced, left ones are only compared against.
+  */
+  std::vector<libusb_device *> arrived_;
+  std::vector<libusb_device *> left_;
+  bool have_hotplug_ = false;
+  libusb_hotplug_callback_handle hotplug_handle_;
+};
+
+} // namespace istatrol
+
+#endif /* _FLEET_H */
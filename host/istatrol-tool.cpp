@@ -0,0 +1,600 @@
+/** \file istatrol-tool.cpp
+
+  Maintenance commands for a single ISTAtrol unit. Unlike istatrold, this
+  talks to the device synchronously, one request after another.
+
+  Usage: istatrol-tool [-u unit] command [arguments]
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "naming.h"
+#include "protocol.h"
+
+using namespace istatrol;
+
+
+/// Timeout for each request. Generous, the firmware may be moving the motor.
+static constexpr unsigned kTimeoutMs = 3000;
+
+static void usage(const char *name) {
+
+  fprintf(stderr,
+    "Usage: %s [-u unit] command [arguments]\n"
+    "\n"
+    "  -u  Serial number or port path (e.g. 1-4.2) of the unit to talk to.\n"
+    "      Not needed if there's only one.\n"
+    "\n"
+    "Commands:\n"
+    "  list           List attached units.\n"
+    "  serial NUMBER  Write the serial number, up to %u characters of\n"
+    "                 0-9, A-Z, a-z, '-' and '_'. Used after the next\n"
+    "                 re-plug. Needs firmware built with SERIAL_NUMBER.\n"
+    "  health         Show the health counters. Needs firmware built with\n"
+    "                 HEALTH.\n"
+    "  histogram start [SHIFT [LOW]]\n"
+    "                 Stop regulating and collect raw captures into bins\n"
+    "                 2^SHIFT wide (default 2), starting at LOW (default\n"
+    "                 around the first capture).\n"
+    "  histogram      Show the histogram collected so far.\n"
+    "  histogram stop Leave histogram mode, regulate again.\n"
+    "                 Histograms need firmware built with HISTOGRAM.\n"
+    "  bandgap [READING]\n"
+    "                 Show the bandgap calibration. With READING, first\n"
+    "                 calibrate for the current reading being READING.\n"
+    "                 Needs firmware built with BANDGAP_REFERENCE.\n"
+    "  buttons [watch]\n"
+    "                 Show the target and the last button events. With\n"
+    "                 watch, keep showing new events as they happen.\n"
+    "                 Needs firmware built with BUTTONS.\n"
+    "  resets         Show what caused the last reset. Needs firmware\n"
+    "                 built with WATCHDOG.\n"
+    "  room           Show the radiator target set by room control and\n"
+    "                 the average radiator excess over the room. Needs\n"
+    "                 firmware built with ROOM_CONTROL.\n"
+    "  shadow         Show how often the candidate regulation agreed\n"
+    "                 with the active one. Needs firmware built with\n"
+    "                 SHADOW.\n",
+    name, kSerialNumberLength);
+}
+
+/**
+  Name of a unit, its serial number if it has one. Needs the device open if
+  sysfs doesn't know.
+*/
+static void unit_name(libusb_device *device, libusb_device_handle *handle,
+                      char *name, size_t size) {
+  struct libusb_device_descriptor descriptor;
+
+  port_path(device, name, size);
+  if (sysfs_serial(name, name, size))
+    return;
+  if (handle && libusb_get_device_descriptor(device, &descriptor) == 0 &&
+      descriptor.iSerialNumber &&
+      libusb_get_string_descriptor_ascii(handle, descriptor.iSerialNumber,
+                                         (unsigned char *)name, size) > 0)
+    sanitize(name);
+}
+
+/**
+  Open the unit asked for, or the only one there is. Returns nullptr and
+  tells why on failure.
+*/
+static libusb_device_handle *open_unit(libusb_context *context,
+                                       const char *wanted, bool list) {
+  libusb_device **devices;
+  libusb_device_handle *found = nullptr;
+  int matches = 0;
+  ssize_t n = libusb_get_device_list(context, &devices);
+
+  for (ssize_t i = 0; i < n; i++) {
+    struct libusb_device_descriptor descriptor;
+    libusb_device_handle *handle = nullptr;
+    char path[32], name[32];
+
+    if (libusb_get_device_descriptor(devices[i], &descriptor) != 0 ||
+        descriptor.idVendor != kVendorId ||
+        descriptor.idProduct != kProductId)
+      continue;
+
+    port_path(devices[i], path, sizeof(path));
+    libusb_open(devices[i], &handle);
+    unit_name(devices[i], handle, name, sizeof(name));
+    if (list)
+      printf("%s\t%s\n", path, name);
+
+    if ( ! list && ( ! wanted || ! strcmp(wanted, path) ||
+                     ! strcmp(wanted, name))) {
+      matches++;
+      if (found)
+        libusb_close(found);
+      found = handle;
+    } else if (handle) {
+      libusb_close(handle);
+    }
+  }
+  if (n >= 0)
+    libusb_free_device_list(devices, 1);
+
+  if ( ! list) {
+    if (matches == 0) {
+      fprintf(stderr, "No unit found.\n");
+    } else if (matches > 1) {
+      fprintf(stderr, "%d units found, pick one with -u.\n", matches);
+    } else if ( ! found) {
+      fprintf(stderr, "Can't open the unit, permissions?\n");
+    }
+    if (matches != 1 && found) {
+      libusb_close(found);
+      found = nullptr;
+    }
+  }
+
+  return found;
+}
+
+static int write_serial(libusb_device_handle *handle, const char *serial) {
+  size_t length = strlen(serial);
+
+  if (length == 0 || length > kSerialNumberLength) {
+    fprintf(stderr, "Serial number must be 1 to %u characters.\n",
+            kSerialNumberLength);
+    return 1;
+  }
+  for (size_t i = 0; i < length; i++)
+    if ( ! isalnum((unsigned char)serial[i]) &&
+        serial[i] != '-' && serial[i] != '_') {
+      fprintf(stderr, "Invalid character '%c' in serial number.\n", serial[i]);
+      return 1;
+    }
+
+  // One character per request. Positions past the end get cleared.
+  for (unsigned i = 0; i < kSerialNumberLength; i++) {
+    uint8_t c = i < length ? serial[i] : 0xFF;
+    unsigned char dummy[kReplyMax];
+    int result = libusb_control_transfer(handle, kRequestTypeIn,
+                                         kRequestSerialNumber, c, i,
+                                         dummy, sizeof(dummy), kTimeoutMs);
+
+    // Firmware without SERIAL_NUMBER answers with a reading instead.
+    if (result > 0) {
+      fprintf(stderr, "Firmware doesn't support serial numbers.\n");
+      return 1;
+    }
+    if (result < 0) {
+      fprintf(stderr, "Writing failed: %s\n", libusb_strerror(result));
+      return 1;
+    }
+  }
+  printf("Serial number written, re-plug the unit to see it.\n");
+
+  return 0;
+}
+
+static int show_health(libusb_device_handle *handle) {
+  unsigned char data[kReplyMax];
+  Health health;
+  int result = libusb_control_transfer(handle, kRequestTypeIn, kRequestHealth,
+                                       0, 0, data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, health)) {
+    fprintf(stderr, "Firmware doesn't support health counters.\n");
+    return 1;
+  }
+
+  printf("uptime          %lu s\n"
+         "usb resets      %u\n"
+         "usbPoll() max   %u ms\n"
+         "retriggers      %u\n"
+         "timeouts        %u\n"
+         "OSCCAL          %u (%u..%u)\n"
+         "enumerated      %u ms\n",
+         (unsigned long)health.uptime_s, health.usb_resets,
+         health.usbpoll_max_ms, health.retriggers, health.timeouts,
+         health.osccal, health.osccal_min, health.osccal_max,
+         health.enumerated_ms);
+
+  return 0;
+}
+
+/**
+  Start or stop histogram mode. The firmware answers 'N' with nothing,
+  firmware without HISTOGRAM with a reading.
+*/
+static int start_histogram(libusb_device_handle *handle, uint16_t low,
+                           uint16_t shift) {
+  unsigned char data[kReplyMax];
+  int result = libusb_control_transfer(handle, kRequestTypeIn,
+                                       kRequestHistogramStart, low, shift,
+                                       data, sizeof(data), kTimeoutMs);
+
+  if (result > 0) {
+    fprintf(stderr, "Firmware doesn't support histograms.\n");
+    return 1;
+  }
+  if (result < 0) {
+    fprintf(stderr, "Writing failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+  Print the histogram with a bar per bin, plus mean and standard deviation
+  of the binned captures, taking each bin's center.
+*/
+static int show_histogram(libusb_device_handle *handle) {
+  static const char *states[] = { "off", "running", "full" };
+  unsigned char data[kHistogramLength];
+  Histogram histogram;
+  unsigned width, largest = 1, count = 0;
+  double sum = 0., squares = 0.;
+  int result = libusb_control_transfer(handle, kRequestTypeIn,
+                                       kRequestHistogram, 0, 0,
+                                       data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, histogram)) {
+    fprintf(stderr, "Firmware doesn't support histograms.\n");
+    return 1;
+  }
+
+  width = 1u << histogram.shift;
+  for (int i = 0; i < kHistogramBins; i++) {
+    double center = histogram.low + (i + .5) * width;
+
+    if (histogram.bins[i] > largest)
+      largest = histogram.bins[i];
+    count += histogram.bins[i];
+    sum += histogram.bins[i] * center;
+    squares += histogram.bins[i] * center * center;
+  }
+
+  printf("state %s, bins %u wide\n",
+         histogram.state <= Histogram::full ? states[histogram.state] : "?",
+         width);
+  printf("   below %5u  %3u\n", histogram.low, histogram.below);
+  for (int i = 0; i < kHistogramBins; i++) {
+    int bar = (histogram.bins[i] * 50 + largest - 1) / largest;
+
+    printf("%8u..%5u  %3u  %.*s\n", histogram.low + i * width,
+           histogram.low + (i + 1) * width - 1, histogram.bins[i], bar,
+           "##################################################");
+  }
+  printf("   above %5u  %3u\n",
+         histogram.low + kHistogramBins * width - 1, histogram.above);
+
+  if (count) {
+    double mean = sum / count;
+
+    printf("%u captures binned, mean %.1f, standard deviation %.1f\n",
+           count, mean, sqrt(squares / count - mean * mean));
+  }
+
+  return 0;
+}
+
+/**
+  Show the bandgap calibration, after calibrating for nominal if that's
+  not 0.
+*/
+static int bandgap(libusb_device_handle *handle, uint16_t nominal) {
+  unsigned char data[kReplyMax];
+  Bandgap bandgap;
+  int result = libusb_control_transfer(handle, kRequestTypeIn,
+                                       kRequestBandgap, nominal, 0,
+                                       data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Request failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, bandgap)) {
+    fprintf(stderr, "Firmware doesn't support bandgap calibration.\n");
+    return 1;
+  }
+
+  if (bandgap.nominal == 1 && bandgap.measured == 1)
+    printf("Not calibrated.\n");
+  else
+    printf("Readings scaled by %u / %u.\n", bandgap.nominal,
+           bandgap.measured);
+
+  return 0;
+}
+
+/**
+  Fetch button state and events, complaining if that fails.
+*/
+static bool read_buttons(libusb_device_handle *handle, Buttons &buttons) {
+  unsigned char data[kReplyMax];
+  int result = libusb_control_transfer(handle, kRequestTypeIn,
+                                       kRequestButtons, 0, 0,
+                                       data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return false;
+  }
+  if ( ! decode(data, result, buttons)) {
+    fprintf(stderr, "Firmware doesn't support buttons.\n");
+    return false;
+  }
+
+  return true;
+}
+
+static void print_event(char event) {
+
+  switch (event) {
+    case '+': printf("PLUS, target lowered (warmer)\n"); break;
+    case '-': printf("MINUS, target raised (colder)\n"); break;
+    case 'o': printf("PLUS held, valve opened\n"); break;
+    case 'c': printf("MINUS held, valve closed\n"); break;
+    default:  printf("unknown event 0x%02x\n", (uint8_t)event); break;
+  }
+}
+
+/**
+  Show target and recent button events. With watch, poll for new events
+  until interrupted. More than kButtonEvents events between two polls
+  can't be shown, that's reported as a gap.
+*/
+static int show_buttons(libusb_device_handle *handle, bool watch) {
+  Buttons buttons;
+  uint8_t seen;
+
+  if ( ! read_buttons(handle, buttons))
+    return 1;
+
+  printf("target %u, buttons down:%s%s\n", buttons.target,
+         buttons.pressed & Buttons::plus ? " PLUS" : "",
+         buttons.pressed & Buttons::minus ? " MINUS" : "");
+  seen = buttons.count < kButtonEvents ? 0 : buttons.count - kButtonEvents;
+
+  do {
+    uint8_t missed = buttons.count - seen;
+
+    if (missed > kButtonEvents) {
+      printf("%u events missed\n", missed - kButtonEvents);
+      seen = buttons.count - kButtonEvents;
+    }
+    for ( ; seen != buttons.count; seen++)
+      print_event(buttons.event(seen));
+    fflush(stdout);
+
+    if (watch)
+      usleep(200 * 1000);
+  } while (watch && read_buttons(handle, buttons));
+
+  return watch ? 1 : 0;
+}
+
+static int show_resets(libusb_device_handle *handle) {
+  unsigned char data[kReplyMax];
+  Resets resets;
+  int result = libusb_control_transfer(handle, kRequestTypeIn, kRequestResets,
+                                       0, 0, data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, resets)) {
+    fprintf(stderr, "Firmware doesn't support the watchdog.\n");
+    return 1;
+  }
+
+  printf("last reset     %s%s%s%s\n",
+         resets.cause & Resets::power_on ? " power-on" : "",
+         resets.cause & Resets::external ? " external" : "",
+         resets.cause & Resets::brown_out ? " brown-out" : "",
+         resets.cause & Resets::watchdog ? " watchdog" : "");
+  printf("watchdog resets %u\n", resets.watchdog_resets);
+  if (resets.stalled)
+    printf("last stalled   %s%s%s\n",
+           resets.stalled & Resets::usb ? " USB" : "",
+           resets.stalled & Resets::measure ? " measuring" : "",
+           resets.stalled & Resets::control ? " regulating" : "");
+
+  return 0;
+}
+
+/**
+  Show room control. The average of radiator over room readouts, units by
+  rounds, is a measure of heat delivered; compare it between days with
+  similar outside temperatures.
+*/
+static int show_room(libusb_device_handle *handle) {
+  unsigned char data[kReplyMax];
+  Room room;
+  int result = libusb_control_transfer(handle, kRequestTypeIn, kRequestRoom,
+                                       0, 0, data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, room)) {
+    fprintf(stderr, "Firmware doesn't support room control.\n");
+    return 1;
+  }
+
+  printf("radiator target %5u  %5.1f C\n", room.target,
+         decicelsius(room.target) / 10.0);
+  if (room.temp_r == kTempFault)
+    printf("room            fault\n");
+  else
+    printf("room            %5u  %5.1f C\n", room.temp_r,
+           decicelsius(room.temp_r) / 10.0);
+  printf("rounds          %lu\n", (unsigned long)room.rounds);
+  if (room.rounds)
+    printf("radiator excess %.1f units on average\n",
+           (double)room.units / room.rounds);
+
+  return 0;
+}
+
+static int show_shadow(libusb_device_handle *handle) {
+  unsigned char data[kReplyMax];
+  Shadow shadow;
+  int result = libusb_control_transfer(handle, kRequestTypeIn, kRequestShadow,
+                                       0, 0, data, sizeof(data), kTimeoutMs);
+
+  if (result < 0) {
+    fprintf(stderr, "Reading failed: %s\n", libusb_strerror(result));
+    return 1;
+  }
+  if ( ! decode(data, result, shadow)) {
+    fprintf(stderr, "Firmware doesn't support shadow regulation.\n");
+    return 1;
+  }
+
+  printf("decisions       %u\n", shadow.decisions);
+  printf("agreed          %u\n", shadow.agreed);
+  printf("disagreed       %u\n",
+         (uint16_t)(shadow.decisions - shadow.agreed));
+  printf("  opposed       %u\n", shadow.opposed);
+  printf("moves active    %u\n", shadow.active_moves);
+  printf("moves candidate %u\n", shadow.shadow_moves);
+  printf("last            active '%c', candidate '%c'\n",
+         shadow.active, shadow.shadow);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *wanted = nullptr, *command;
+  libusb_context *context;
+  libusb_device_handle *handle;
+  int option, result = 1;
+
+  while ((option = getopt(argc, argv, "u:h")) != -1) {
+    switch (option) {
+      case 'u':
+        wanted = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  command = argv[optind++];
+
+  if (libusb_init(&context) != LIBUSB_SUCCESS) {
+    fprintf(stderr, "Can't initialise libusb.\n");
+    return 1;
+  }
+
+  if ( ! strcmp(command, "list")) {
+    open_unit(context, nullptr, true);
+    result = 0;
+  } else if ( ! strcmp(command, "serial") && optind + 1 == argc) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = write_serial(handle, argv[optind]);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "health") && optind == argc) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = show_health(handle);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "histogram") && optind + 3 >= argc) {
+    const char *action = optind < argc ? argv[optind] : "show";
+    int extra = argc - optind - 1;
+    uint16_t shift = extra >= 1 ? atoi(argv[optind + 1]) : 2;
+    uint16_t low = extra >= 2 ? atoi(argv[optind + 2]) : 0;
+
+    if ( ! strcmp(action, "start") && shift > 15) {
+      fprintf(stderr, "SHIFT must be 0..15.\n");
+    } else if (strcmp(action, "start") &&
+               ((strcmp(action, "stop") && strcmp(action, "show")) ||
+                extra > 0)) {
+      usage(argv[0]);
+    } else if ((handle = open_unit(context, wanted, false))) {
+      if ( ! strcmp(action, "start"))
+        result = start_histogram(handle, low, shift);
+      else if ( ! strcmp(action, "stop"))
+        result = start_histogram(handle, 0, kHistogramStop);
+      else
+        result = show_histogram(handle);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "bandgap") && optind + 1 >= argc) {
+    long nominal = optind < argc ? atol(argv[optind]) : 0;
+
+    if (nominal < 0 || nominal >= kTempMax) {
+      fprintf(stderr, "READING must be 1..%u.\n", kTempMax - 1);
+    } else if ((handle = open_unit(context, wanted, false))) {
+      result = bandgap(handle, nominal);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "buttons") && optind + 1 >= argc &&
+             (optind == argc || ! strcmp(argv[optind], "watch"))) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = show_buttons(handle, optind < argc);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "resets") && optind == argc) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = show_resets(handle);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "room") && optind == argc) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = show_room(handle);
+      libusb_close(handle);
+    }
+  } else if ( ! strcmp(command, "shadow") && optind == argc) {
+    handle = open_unit(context, wanted, false);
+    if (handle) {
+      result = show_shadow(handle);
+      libusb_close(handle);
+    }
+  } else {
+    usage(argv[0]);
+  }
+
+  libusb_exit(context);
+
+  return result;
+}
@@ -0,0 +1,789 @@
+/** \file istatrol-virtual.cpp
+
+  Virtual ISTAtrol units for load-testing host software without hardware.
+
+  Each unit speaks exactly what the firmware speaks: the descriptors of
+  firmware/usbconfig.h and the vendor requests of usbFunctionSetup(). Its
+  readings come from a Plant, regulated by a copy of the control loop in the
+  firmware's main(), so host software sees valve movements, slow
+  temperature drifts and noise like on a real radiator.
+
+  The copy is the one of the default build, without any of the optional
+  FEATURES in firmware/Makefile: smoothing in 32 bits, the valve held with
+  '!' on a faulty sensor, the decision count in each reading. Units given
+  with -f have no TEMP_C sensor, like one unplugged.
+
+  Units are exported as a USB/IP server. The Linux vhci-hcd driver makes
+  them real USB devices on the local machine, with no limit on their number
+  other than the ports vhci-hcd was built with:
+
+    sudo modprobe vhci-hcd
+    istatrol-virtual -n 100 &
+    for i in $(seq 1 100); do sudo usbip attach -r localhost -b 1-$i; done
+
+  Everything runs in one poll() loop. A unit's firmware is advanced on
+  demand, whenever the host asks for a reading, so idle units cost nothing.
+
+  Usage: istatrol-virtual [-n units] [-p port] [-x speedup] [-m] [-u seconds]
+                          [-f units]
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "plant.h"
+#include "protocol.h"
+
+using namespace istatrol;
+
+
+/// Default TCP port of USB/IP.
+static constexpr uint16_t kPortDefault = 3240;
+
+/// More units don't fit into vhci-hcd, whatever it was built with.
+static constexpr unsigned kUnitsMax = 2048;
+
+/// Copies of the firmware's regulation parameters, see firmware/main.c.
+static constexpr uint16_t kTargetTemperature = 5800;
+static constexpr uint16_t kThermistorHysteresis = 50;
+static constexpr uint16_t kRadiatorResponseTime = 120;
+static constexpr int16_t kPredictionSteepness = 4;
+static constexpr int kMotOpenTime = 200;
+static constexpr int kMotCloseTime = 400;
+
+/// USB/IP protocol, see Documentation/usb/usbip_protocol.rst in Linux.
+static constexpr uint16_t kUsbipVersion = 0x0111;
+static constexpr uint16_t kOpReqDevlist = 0x8005;
+static constexpr uint16_t kOpRepDevlist = 0x0005;
+static constexpr uint16_t kOpReqImport = 0x8003;
+static constexpr uint16_t kOpRepImport = 0x0003;
+static constexpr uint32_t kCmdSubmit = 1;
+static constexpr uint32_t kCmdUnlink = 2;
+static constexpr uint32_t kRetSubmit = 3;
+static constexpr uint32_t kRetUnlink = 4;
+static constexpr uint32_t kDirIn = 1;
+static constexpr uint32_t kStatusOk = 0;
+static constexpr uint32_t kStatusBusy = 2;
+static constexpr uint32_t kStatusNoDevice = 4;
+static constexpr uint32_t kSpeedLow = 1;
+static constexpr size_t kOpHeaderSize = 8;
+static constexpr size_t kBusidSize = 32;
+static constexpr size_t kDeviceSize = 312;
+static constexpr size_t kUrbHeaderSize = 48;
+
+/// Largest control transfer we accept, there's nothing that big anyways.
+static constexpr size_t kTransferMax = 256;
+
+
+/**
+  The firmware of one unit: its variables and the loop in main(), with
+  poll_a_second() replaced by letting the Plant run for a second.
+*/
+class Firmware {
+ public:
+  Firmware(uint32_t seed, bool multisensor, bool sensor_missing)
+    : plant_(seed), multisensor_(multisensor),
+      sensor_missing_(sensor_missing) {}
+
+  /// Run the main loop until the given simulated time, in seconds.
+  void run_until(double seconds) {
+    double period = multisensor_ ? 3. : 1.;
+
+    while (now_ + period <= seconds) {
+      loop();
+      now_ += period;
+    }
+  }
+
+  /// struct answer, as the firmware sends it.
+  int answer(uint8_t *data) const {
+
+    data[0] = temp_last_ & 0xFF;
+    data[1] = temp_last_ >> 8;
+    data[2] = motor_moved_;
+    if ( ! multisensor_) {
+      data[3] = decisions_;
+      return kReadingLength;
+    }
+
+    data[3] = temp_v_ & 0xFF;
+    data[4] = temp_v_ >> 8;
+    data[5] = temp_r_ & 0xFF;
+    data[6] = temp_r_ >> 8;
+    data[7] = decisions_;
+    return kReadingLengthMultisensor;
+  }
+
+ private:
+  /// temp_smooth().
+  static void smooth(uint16_t &average, uint32_t &eight, uint16_t reading) {
+
+    if (reading == kTempFault) {
+      average = kTempFault;
+    } else {
+      if (average == kTempFault)
+        eight = reading * 8UL;
+      else
+        eight = eight - average + reading;
+      average = eight / 8;
+    }
+  }
+
+  void loop() {
+
+    // temp_measure(), temp_channel() clamping to TEMP_MAX.
+    plant_.step(1.);
+    if (sensor_missing_) {
+      smooth(temp_c_, temp_temp_eight_, kTempFault);
+    } else {
+      uint16_t reading = plant_.readout_c();
+
+      smooth(temp_c_, temp_temp_eight_,
+             reading < kTempMax ? reading : kTempMax);
+    }
+    if (multisensor_) {
+      plant_.step(1.);
+      temp_v_ = plant_.readout_v();
+      plant_.step(1.);
+      temp_r_ = plant_.readout_r();
+    }
+
+    // Hold the valve on a faulty sensor.
+    if (temp_c_ == kTempFault) {
+      temp_last_ = kTempFault;
+      motor_moved_ = '!';
+      time_ = 0;
+      return;
+    }
+
+    time_++;
+    if (time_ > kRadiatorResponseTime) {
+      uint16_t temp_future;
+
+      // No trend to extrapolate right after a sensor fault.
+      if (temp_last_ == kTempFault)
+        temp_last_ = temp_c_;
+      temp_future = temp_c_ + kPredictionSteepness *
+                    ((int16_t)temp_c_ - (int16_t)temp_last_);
+
+      if (temp_future < kTargetTemperature - kThermistorHysteresis) {
+        plant_.move(-kMotCloseTime);
+        motor_moved_ = '-';
+      } else if (temp_future > kTargetTemperature + kThermistorHysteresis) {
+        plant_.move(kMotOpenTime);
+        motor_moved_ = '+';
+      } else {
+        motor_moved_ = ' ';
+      }
+
+      time_ = 0;
+      temp_last_ = temp_c_;
+      decisions_++;
+    }
+  }
+
+  Plant plant_;
+  bool multisensor_;
+  bool sensor_missing_;
+  double now_ = 0.;
+  uint16_t time_ = 0;
+  uint16_t temp_c_ = kTempFault;
+  uint32_t temp_temp_eight_ = 0;
+  uint16_t temp_v_ = 0;
+  uint16_t temp_r_ = 0;
+  uint16_t temp_last_ = 0;
+  char motor_moved_ = 0;
+  uint8_t decisions_ = 0;
+};
+
+struct VirtualUnit {
+  VirtualUnit(unsigned number, bool multisensor, bool sensor_missing,
+              double phase)
+    : firmware(number, multisensor, sensor_missing), number(number),
+      phase(phase) {
+    snprintf(busid, sizeof(busid), "1-%u", number);
+    snprintf(serial, sizeof(serial), "VIRT%04u", number);
+  }
+
+  Firmware firmware;
+  unsigned number;
+  /// Simulated time this unit was powered up before we started.
+  double phase;
+  char busid[kBusidSize];
+  /// Like EEPROM_SERIAL_NUMBER, written with kRequestSerialNumber.
+  char serial[kSerialNumberLength + 1];
+  /// Descriptor copy, taken at attach like serial_init() does at reset.
+  char serial_descriptor[kSerialNumberLength + 1];
+  uint8_t configuration = 0;
+  bool attached = false;
+};
+
+/**
+  A TCP connection, first speaking the USB/IP operations, then, after an
+  import, carrying the URBs of one unit.
+*/
+struct Connection {
+  explicit Connection(int fd) : fd(fd) {}
+
+  int fd;
+  VirtualUnit *unit = nullptr;
+  uint8_t buffer[kUrbHeaderSize + kTransferMax];
+  size_t length = 0;
+};
+
+static unsigned units_count = 1;
+static double speedup = 1.;
+static double start_seconds;
+static std::vector<std::unique_ptr<VirtualUnit>> units;
+static std::vector<std::unique_ptr<Connection>> connections;
+static volatile sig_atomic_t quit = 0;
+
+
+static void usage(const char *name) {
+
+  fprintf(stderr,
+    "Usage: %s [-n units] [-p port] [-x speedup] [-m] [-u seconds]\n"
+    "       [-f units]\n"
+    "\n"
+    "Export virtual ISTAtrol units over USB/IP on localhost. Attach them\n"
+    "with 'usbip attach -r localhost -b 1-N', N from 1 to the number of\n"
+    "units.\n"
+    "\n"
+    "  -n  Number of units, default 1.\n"
+    "  -p  TCP port, default %u. Pass the same to usbip --tcp-port.\n"
+    "  -x  Run simulated time faster than real time by this factor.\n"
+    "  -m  Send readings like firmware built with MULTISENSOR_BROKEN.\n"
+    "  -u  Unplug a random attached unit about every this many seconds.\n"
+    "  -f  Number of units without a TEMP_C sensor, default 0.\n",
+    name, kPortDefault);
+}
+
+static void handle_signal(int) {
+  quit = 1;
+}
+
+static double monotonic_seconds() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t value) {
+  *p++ = value >> 8;
+  *p++ = value;
+  return p;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t value) {
+  p = put16(p, value >> 16);
+  return put16(p, value);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static bool send_all(int fd, const uint8_t *data, size_t length) {
+
+  while (length) {
+    ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+/* ---- Descriptors, as V-USB builds them from usbconfig.h ---------------- */
+
+static int device_descriptor(uint8_t *d) {
+  static const uint8_t descriptor[] = {
+    18, 1,                    // bLength, bDescriptorType
+    0x10, 0x01,               // bcdUSB 1.1
+    0xff, 0, 0,               // USB_CFG_DEVICE_CLASS, SUBCLASS, protocol
+    8,                        // bMaxPacketSize0
+    kVendorId & 0xFF, kVendorId >> 8,
+    kProductId & 0xFF, kProductId >> 8,
+    0x00, 0x01,               // USB_CFG_DEVICE_VERSION
+    1, 2, 3,                  // iManufacturer, iProduct, iSerialNumber
+    1                         // bNumConfigurations
+  };
+
+  memcpy(d, descriptor, sizeof(descriptor));
+  return sizeof(descriptor);
+}
+
+static int configuration_descriptor(uint8_t *d) {
+  static const uint8_t descriptor[] = {
+    9, 2, 18, 0,              // bLength, bDescriptorType, wTotalLength
+    1, 1, 0,                  // bNumInterfaces, bConfigurationValue, iConf.
+    0x80, 100 / 2,            // bus powered, USB_CFG_MAX_BUS_POWER
+    9, 4, 0, 0, 0,            // interface 0, alternate 0, no endpoints
+    0, 0, 0, 0                // USB_CFG_INTERFACE_CLASS etc., iInterface
+  };
+
+  memcpy(d, descriptor, sizeof(descriptor));
+  return sizeof(descriptor);
+}
+
+static int string_descriptor(const char *text, uint8_t *d) {
+  int n = 2;
+
+  for ( ; *text; text++) {
+    d[n++] = *text;
+    d[n++] = 0;
+  }
+  d[0] = n;
+  d[1] = 3;
+  return n;
+}
+
+/* ---- Control transfers ------------------------------------------------- */
+
+/**
+  Handle a control transfer. Returns the reply length, or -EPIPE for a
+  stall.
+*/
+static int control(VirtualUnit &unit, const uint8_t *setup, uint8_t *reply) {
+  uint8_t type = setup[0], request = setup[1];
+  uint16_t value = setup[2] | setup[3] << 8;
+  uint16_t index = setup[4] | setup[5] << 8;
+  int length = 0;
+
+  if ((type & 0x60) == 0x40) {
+    // usbFunctionSetup().
+    if (request == kRequestSerialNumber) {
+      if (index < kSerialNumberLength)
+        unit.serial[index] = value == 0xFF ? '\0' : value;
+      return 0;
+    }
+    unit.firmware.run_until(unit.phase +
+                            (monotonic_seconds() - start_seconds) * speedup);
+    return unit.firmware.answer(reply);
+  }
+  if (type & 0x60)
+    return -EPIPE;
+
+  switch (request) {
+    case 0:   // GET_STATUS
+      reply[0] = reply[1] = 0;
+      length = 2;
+      break;
+    case 6:   // GET_DESCRIPTOR
+      switch (value >> 8) {
+        case 1:
+          length = device_descriptor(reply);
+          break;
+        case 2:
+          length = configuration_descriptor(reply);
+          break;
+        case 3:
+          switch (value & 0xFF) {
+            case 0:
+              reply[0] = 4; reply[1] = 3; reply[2] = 0x09; reply[3] = 0x04;
+              length = 4;
+              break;
+            case 1:
+              length = string_descriptor("RepRap DIY", reply);
+              break;
+            case 2:
+              length = string_descriptor("ISTAtrol", reply);
+              break;
+            case 3:
+              length = string_descriptor(unit.serial_descriptor, reply);
+              break;
+            default:
+              return -EPIPE;
+          }
+          break;
+        default:
+          return -EPIPE;
+      }
+      break;
+    case 8:   // GET_CONFIGURATION
+      reply[0] = unit.configuration;
+      length = 1;
+      break;
+    case 9:   // SET_CONFIGURATION
+      unit.configuration = value;
+      break;
+    default:
+      // V-USB acknowledges everything else without doing anything.
+      break;
+  }
+
+  return length;
+}
+
+/* ---- USB/IP ------------------------------------------------------------ */
+
+static uint8_t *put_device(uint8_t *p, const VirtualUnit &unit) {
+  char path[256] = "";
+
+  snprintf(path, sizeof(path), "/sys/devices/virtual/istatrol/%s",
+           unit.busid);
+  memcpy(p, path, sizeof(path));
+  p += sizeof(path);
+  memset(p, 0, kBusidSize);
+  memcpy(p, unit.busid, strlen(unit.busid));
+  p += kBusidSize;
+  p = put32(p, 1);                // busnum
+  p = put32(p, unit.number);      // devnum
+  p = put32(p, kSpeedLow);
+  p = put16(p, kVendorId);
+  p = put16(p, kProductId);
+  p = put16(p, 0x0100);           // bcdDevice
+  *p++ = 0xff;                    // bDeviceClass
+  *p++ = 0;                       // bDeviceSubClass
+  *p++ = 0;                       // bDeviceProtocol
+  *p++ = unit.configuration;
+  *p++ = 1;                       // bNumConfigurations
+  *p++ = 1;                       // bNumInterfaces
+  return p;
+}
+
+static uint8_t *put_op_header(uint8_t *p, uint16_t code, uint32_t status) {
+  p = put16(p, kUsbipVersion);
+  p = put16(p, code);
+  return put32(p, status);
+}
+
+/**
+  Process what's in the buffer of a connection. Returns the number of bytes
+  consumed, 0 if more is needed, -1 to close the connection.
+*/
+static ssize_t process(Connection &c) {
+  uint8_t reply[kUrbHeaderSize + kTransferMax];
+  uint8_t *p = reply;
+
+  if ( ! c.unit) {
+    uint16_t code;
+
+    if (c.length < kOpHeaderSize)
+      return 0;
+    code = c.buffer[2] << 8 | c.buffer[3];
+
+    if (code == kOpReqDevlist) {
+      std::vector<uint8_t> list(kOpHeaderSize + 4 +
+                                units.size() * (kDeviceSize + 4));
+
+      p = put_op_header(list.data(), kOpRepDevlist, kStatusOk);
+      p = put32(p, units.size());
+      for (auto &unit : units) {
+        p = put_device(p, *unit);
+        *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 0; // Interface class etc.
+      }
+      send_all(c.fd, list.data(), p - list.data());
+      return -1;
+    }
+
+    if (code == kOpReqImport) {
+      VirtualUnit *found = nullptr;
+      char busid[kBusidSize + 1] = "";
+
+      if (c.length < kOpHeaderSize + kBusidSize)
+        return 0;
+      memcpy(busid, c.buffer + kOpHeaderSize, kBusidSize);
+      for (auto &unit : units)
+        if ( ! strcmp(unit->busid, busid))
+          found = unit.get();
+
+      if ( ! found || found->attached) {
+        p = put_op_header(p, kOpRepImport,
+                          found ? kStatusBusy : kStatusNoDevice);
+        send_all(c.fd, reply, p - reply);
+        return -1;
+      }
+
+      // Like a reset: the serial number becomes visible now.
+      found->attached = true;
+      found->configuration = 0;
+      memcpy(found->serial_descriptor, found->serial,
+             sizeof(found->serial_descriptor));
+      c.unit = found;
+      p = put_op_header(p, kOpRepImport, kStatusOk);
+      p = put_device(p, *found);
+      if ( ! send_all(c.fd, reply, p - reply))
+        return -1;
+      fprintf(stderr, "%s attached.\n", found->busid);
+      return kOpHeaderSize + kBusidSize;
+    }
+
+    return -1;
+  }
+
+  // URBs.
+  if (c.length < kUrbHeaderSize)
+    return 0;
+  {
+    uint32_t command = get32(c.buffer);
+    uint32_t seqnum = get32(c.buffer + 4);
+    uint32_t direction = get32(c.buffer + 12);
+    uint32_t ep = get32(c.buffer + 16);
+    uint32_t length = get32(c.buffer + 24);
+    size_t needed = kUrbHeaderSize;
+    int result = 0;
+
+    if (command == kCmdUnlink) {
+      // Everything gets answered right away, so there's nothing to unlink.
+      p = put32(p, kRetUnlink);
+      p = put32(p, seqnum);
+      p = put32(p, 0);
+      p = put32(p, 0);
+      p = put32(p, 0);
+      p = put32(p, 0);              // status
+      memset(p, 0, 24);
+      p += 24;
+      return send_all(c.fd, reply, p - reply) ? (ssize_t)needed : -1;
+    }
+    if (command != kCmdSubmit)
+      return -1;
+
+    if (direction != kDirIn) {
+      if (length > kTransferMax)
+        return -1;
+      needed += length;
+      if (c.length < needed)
+        return 0;
+    }
+
+    if (ep == 0)
+      result = control(*c.unit, c.buffer + 40, reply + kUrbHeaderSize);
+    else
+      result = -EPIPE;
+    if (result > (int)length)
+      result = length;
+    if (result >= 0 && direction != kDirIn)
+      result = length;
+
+    p = put32(p, kRetSubmit);
+    p = put32(p, seqnum);
+    p = put32(p, 0);
+    p = put32(p, 0);
+    p = put32(p, 0);
+    p = put32(p, result < 0 ? result : 0);    // status
+    p = put32(p, result < 0 ? 0 : result);    // actual_length
+    p = put32(p, 0);                          // start_frame
+    p = put32(p, 0);                          // number_of_packets
+    p = put32(p, 0);                          // error_count
+    memset(p, 0, 8);
+    p += 8;
+    if (result > 0 && direction == kDirIn)
+      p += result;
+
+    return send_all(c.fd, reply, p - reply) ? (ssize_t)needed : -1;
+  }
+}
+
+static void disconnect(size_t i) {
+  Connection &c = *connections[i];
+
+  if (c.unit) {
+    c.unit->attached = false;
+    fprintf(stderr, "%s detached.\n", c.unit->busid);
+  }
+  close(c.fd);
+  connections.erase(connections.begin() + i);
+}
+
+static int listen_on(uint16_t port) {
+  struct sockaddr_in address;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(fd, 64) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int main(int argc, char *argv[]) {
+  struct sigaction action;
+  unsigned long port = kPortDefault;
+  double unplug_seconds = 0., next_unplug = 0.;
+  bool multisensor = false;
+  unsigned long faulty = 0;
+  std::mt19937 random(1);
+  int option, listener;
+
+  while ((option = getopt(argc, argv, "n:p:x:mu:f:h")) != -1) {
+    switch (option) {
+      case 'n':
+        units_count = strtoul(optarg, nullptr, 10);
+        break;
+      case 'p':
+        port = strtoul(optarg, nullptr, 10);
+        break;
+      case 'x':
+        speedup = strtod(optarg, nullptr);
+        break;
+      case 'm':
+        multisensor = true;
+        break;
+      case 'u':
+        unplug_seconds = strtod(optarg, nullptr);
+        break;
+      case 'f':
+        faulty = strtoul(optarg, nullptr, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (units_count < 1 || units_count > kUnitsMax || port < 1 ||
+      port > 65535 || speedup <= 0. || unplug_seconds < 0. ||
+      faulty > units_count) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  listener = listen_on(port);
+  if (listener < 0) {
+    fprintf(stderr, "Can't listen on port %lu: %s\n", port, strerror(errno));
+    return 1;
+  }
+
+  // Units got powered up at different times, so they don't all make their
+  // control decisions in the same second.
+  {
+    std::uniform_real_distribution<double> phase(0., kRadiatorResponseTime);
+
+    for (unsigned i = 1; i <= units_count; i++)
+      units.emplace_back(new VirtualUnit(i, multisensor, i <= faulty,
+                                         phase(random)));
+  }
+  start_seconds = monotonic_seconds();
+  if (unplug_seconds > 0.)
+    next_unplug = start_seconds + unplug_seconds;
+  fprintf(stderr, "%u units on port %lu.\n", units_count, port);
+
+  while ( ! quit) {
+    std::vector<struct pollfd> fds(connections.size() + 1);
+    int timeout = -1;
+
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < connections.size(); i++) {
+      fds[i + 1].fd = connections[i]->fd;
+      fds[i + 1].events = POLLIN;
+    }
+    if (next_unplug > 0.) {
+      double wait = next_unplug - monotonic_seconds();
+
+      timeout = wait > 0. ? (int)(wait * 1000.) + 1 : 0;
+    }
+
+    if (poll(fds.data(), fds.size(), timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    // Walk backwards, disconnect() removes entries.
+    for (size_t i = connections.size(); i-- > 0; ) {
+      Connection &c = *connections[i];
+      ssize_t n;
+
+      if ( ! fds[i + 1].revents)
+        continue;
+      n = recv(c.fd, c.buffer + c.length, sizeof(c.buffer) - c.length, 0);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR)
+          continue;
+        disconnect(i);
+        continue;
+      }
+      c.length += n;
+
+      while ((n = process(c)) > 0) {
+        c.length -= n;
+        memmove(c.buffer, c.buffer + n, c.length);
+      }
+      if (n < 0 || c.length == sizeof(c.buffer))
+        disconnect(i);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+      if (fd >= 0) {
+        int one = 1;
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        connections.emplace_back(new Connection(fd));
+      }
+    }
+
+    if (next_unplug > 0. && monotonic_seconds() >= next_unplug) {
+      std::vector<size_t> attached;
+
+      for (size_t i = 0; i < connections.size(); i++)
+        if (connections[i]->unit)
+          attached.push_back(i);
+      if ( ! attached.empty())
+        disconnect(attached[random() % attached.size()]);
+
+      std::exponential_distribution<double> interval(1. / unplug_seconds);
+      next_unplug = monotonic_seconds() + interval(random);
+    }
+  }
+
+  while ( ! connections.empty())
+    disconnect(connections.size() - 1);
+  close(listener);
+
+  return 0;
+}
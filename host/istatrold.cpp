@@ -0,0 +1,140 @@
+/** \file istatrold.cpp
+
+  Host daemon for the ISTAtrol heating valve controller. Successor of
+  terminal.py for always-on hosts.
+
+  Everything runs in a single libusb event loop. Between two samples the
+  process sleeps in poll(2) until either the next sample is due or a transfer
+  completes, so there are no wakeups beyond the ones the sample interval
+  asks for.
+
+  All attached units are served, see fleet.h. Units are named by their
+  serial number, if they have one, else by where they're plugged in.
+
+  Device arrival and removal come in as libusb hotplug events, so a unit
+  resetting (e.g. during a long motor_close()) is re-attached as soon as it
+  enumerates again and sampling resumes right away. Where libusb lacks
+  hotplug support, missing units are searched for every kRescanMs.
+
+  Usage: istatrold [-i interval_ms] [-n in_flight] [-f csv|json] [-o file]
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libusb-1.0/libusb.h>
+
+#include "fleet.h"
+#include "output.h"
+#include "protocol.h"
+
+using namespace istatrol;
+
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int) {
+  quit = 1;
+}
+
+static void usage(const char *name) {
+
+  fprintf(stderr,
+    "Usage: %s [-i interval_ms] [-n in_flight] [-f csv|json] [-o file]\n"
+    "\n"
+    "  -i  Sample interval in milliseconds, default 60000, minimum %u.\n"
+    "  -n  Maximum number of requests in flight per USB bus, default %u.\n"
+    "  -f  Output format, default csv.\n"
+    "  -o  Append output to this file instead of writing to stdout.\n",
+    name, kMeasurementPeriodMs, kMaxInFlightDefault);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned interval = 60000;
+  Format format = Format::csv;
+  int fd = STDOUT_FILENO;
+  libusb_context *context;
+  struct sigaction action;
+  unsigned max_in_flight = kMaxInFlightDefault;
+  int option, result;
+
+  while ((option = getopt(argc, argv, "i:n:f:o:h")) != -1) {
+    switch (option) {
+      case 'i':
+        interval = strtoul(optarg, nullptr, 0);
+        if (interval < kMeasurementPeriodMs) {
+          // Asking more often than the device measures is pointless.
+          fprintf(stderr, "Interval raised to %u ms.\n", kMeasurementPeriodMs);
+          interval = kMeasurementPeriodMs;
+        }
+        break;
+      case 'n':
+        max_in_flight = strtoul(optarg, nullptr, 0);
+        if (max_in_flight < 1)
+          max_in_flight = 1;
+        break;
+      case 'f':
+        if (strcmp(optarg, "csv") == 0) {
+          format = Format::csv;
+        } else if (strcmp(optarg, "json") == 0) {
+          format = Format::json;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'o':
+        fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+          perror(optarg);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+
+  // No SA_RESTART, so a signal gets us out of poll(2) right away.
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  result = libusb_init(&context);
+  if (result != LIBUSB_SUCCESS) {
+    fprintf(stderr, "libusb: %s\n", libusb_strerror(result));
+    return 1;
+  }
+
+  {
+    Output output(fd, format);
+    Fleet fleet(context, output, max_in_flight);
+
+    output.header();
+    result = fleet.run(interval, quit);
+  }
+  libusb_exit(context);
+
+  return result;
+}
@@ -0,0 +1,71 @@
+/** \file naming.cpp
+
+  How units get their names. See naming.h.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "naming.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+
+namespace istatrol {
+
+void port_path(libusb_device *device, char *name, size_t size) {
+  uint8_t ports[8];
+  int n, pos;
+
+  pos = snprintf(name, size, "%u", libusb_get_bus_number(device));
+  n = libusb_get_port_numbers(device, ports, sizeof(ports));
+  for (int i = 0; i < n && pos < (int)size; i++)
+    pos += snprintf(name + pos, size - pos, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+bool sysfs_serial(const char *path, char *serial, size_t size) {
+  char file[64];
+  ssize_t n;
+  int fd;
+
+  snprintf(file, sizeof(file), "/sys/bus/usb/devices/%s/serial", path);
+  fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  n = read(fd, serial, size - 1);
+  close(fd);
+
+  while (n > 0 && (serial[n - 1] == '\n' || serial[n - 1] == ' '))
+    n--;
+  if (n <= 0)
+    return false;
+  serial[n] = '\0';
+  sanitize(serial);
+
+  return true;
+}
+
+void sanitize(char *name) {
+
+  for ( ; *name; name++)
+    if (*name <= ' ' || *name >= 0x7f || *name == '"' || *name == ',')
+      *name = '_';
+}
+
+} // namespace istatrol
@@ -0,0 +1,54 @@
+/** \file naming.h
+
+  How units get their names: serial number if they have one, else where
+  they're plugged in.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _NAMING_H
+#define _NAMING_H
+
+#include <stddef.h>
+#include <libusb-1.0/libusb.h>
+
+
+namespace istatrol {
+
+/**
+  Write where the device is plugged in, e.g. "1-4.2", into name. That's the
+  same as the kernel's name for it.
+*/
+void port_path(libusb_device *device, char *name, size_t size);
+
+/**
+  Read the serial number of the device named by port_path() from sysfs.
+  The kernel read it at enumeration already, so this costs no USB traffic
+  and doesn't need the device opened. Returns false if there's none or
+  we're not on Linux.
+*/
+bool sysfs_serial(const char *path, char *serial, size_t size);
+
+/**
+  Make a serial number safe for CSV and JSON output: everything but
+  printable ASCII, quotes and commas becomes '_'.
+*/
+void sanitize(char *name);
+
+} // namespace istatrol
+
+#endif /* _NAMING_H */
@@ -0,0 +1,163 @@
+/** \file output.cpp
+
+  Writing readings as CSV or JSON lines. See output.h.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "output.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+
+namespace istatrol {
+
+void Output::header() {
+
+  if (format_ == Format::csv) {
+    pos_ = 0;
+    put("time_ms,unit,reading,celsius,valve,reading_v,reading_r");
+    end();
+  }
+}
+
+void Output::reading(const char *id, uint64_t time_ms,
+                     const Reading &reading) {
+
+  begin(id, time_ms);
+  if (format_ == Format::csv) {
+    put_uint(reading.temp_c);
+    put(',');
+    if (reading.temp_c != kTempFault)
+      put_tenths(decicelsius(reading.temp_c));
+    put(',');
+    put(reading.motor_moved);
+    put(',');
+    if (reading.multisensor) {
+      put_uint(reading.temp_v);
+      put(',');
+      put_uint(reading.temp_r);
+    } else {
+      put(',');
+    }
+  } else {
+    put("\"reading\":");
+    put_uint(reading.temp_c);
+    put(",\"celsius\":");
+    if (reading.temp_c != kTempFault)
+      put_tenths(decicelsius(reading.temp_c));
+    else
+      put("null");
+    put(",\"valve\":\"");
+    put(reading.motor_moved);
+    put('"');
+    if (reading.multisensor) {
+      put(",\"reading_v\":");
+      put_uint(reading.temp_v);
+      put(",\"reading_r\":");
+      put_uint(reading.temp_r);
+    }
+    put('}');
+  }
+  end();
+}
+
+void Output::note(const char *id, uint64_t time_ms, const char *text) {
+
+  begin(id, time_ms);
+  if (format_ == Format::csv) {
+    put(",,#");
+    put(text);
+  } else {
+    put("\"note\":\"");
+    put(text);
+    put("\"}");
+  }
+  end();
+}
+
+/**
+  Everything up to and including the separator after the unit ID.
+*/
+void Output::begin(const char *id, uint64_t time_ms) {
+
+  pos_ = 0;
+  if (format_ == Format::csv) {
+    put_uint(time_ms);
+    put(',');
+    put(id);
+    put(',');
+  } else {
+    put("{\"time_ms\":");
+    put_uint(time_ms);
+    put(",\"unit\":\"");
+    put(id);
+    put("\",");
+  }
+}
+
+void Output::put(const char *text) {
+
+  while (*text)
+    put(*text++);
+}
+
+void Output::put_uint(uint64_t value) {
+  char digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+
+  while (n)
+    put(digits[--n]);
+}
+
+/**
+  Print a value given in tenths with one decimal, e.g. 215 -> "21.5".
+*/
+void Output::put_tenths(int32_t value) {
+
+  if (value < 0) {
+    put('-');
+    value = -value;
+  }
+  put_uint(value / 10);
+  put('.');
+  put((char)('0' + value % 10));
+}
+
+void Output::end() {
+  size_t done = 0;
+
+  line_[pos_++] = '\n'; // put() always leaves room for this.
+  while (done < pos_) {
+    ssize_t n = write(fd_, line_ + done, pos_ - done);
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break; // Nobody to complain to, output is where we'd complain.
+    }
+    done += n;
+  }
+}
+
+} // namespace istatrol
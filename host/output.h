@@ -0,0 +1,68 @@
+/** \file output.h
+
+  Writing readings as CSV or JSON lines.
+
+  A line is assembled in a fixed buffer with hand made number formatting and
+  written with a single write(2), so there's no stdio buffering to lose on a
+  crash and no allocation per reading.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _OUTPUT_H
+#define _OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+
+namespace istatrol {
+
+enum class Format { csv, json };
+
+class Output {
+ public:
+  Output(int fd, Format format) : fd_(fd), format_(format) {}
+
+  /// Column names, CSV only.
+  void header();
+
+  /// One reading of the unit identified by id.
+  void reading(const char *id, uint64_t time_ms, const Reading &reading);
+
+  /// Anything else worth a line, e.g. a unit going away.
+  void note(const char *id, uint64_t time_ms, const char *text);
+
+ private:
+  void begin(const char *id, uint64_t time_ms);
+  void put(const char *text);
+  void put(char c) { if (pos_ < sizeof(line_) - 1) line_[pos_++] = c; }
+  void put_uint(uint64_t value);
+  void put_tenths(int32_t value);
+  void end();
+
+  int fd_;
+  Format format_;
+  char line_[256];
+  size_t pos_ = 0;
+};
+
+} // namespace istatrol
+
+#endif /* _OUTPUT_H */
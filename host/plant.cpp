@@ -0,0 +1,94 @@
+/** \file plant.cpp
+
+  The thermal model behind istatrol-virtual. See plant.h.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "plant.h"
+
+#include <math.h>
+
+
+namespace istatrol {
+
+/// Time constant of the ISTA sensor following the radiator surface, seconds.
+static constexpr double kSensorLag = 60.;
+/// Same for the valve body following the water flowing through.
+static constexpr double kValveLag = 30.;
+/// Standard deviation of readout noise, in ADC counts.
+static constexpr double kNoise = 20.;
+
+Plant::Plant(uint32_t seed) : random_(seed), noise_(0., kNoise) {
+  std::uniform_real_distribution<double> spread(0.8, 1.2);
+
+  supply_ = 55. * spread(random_);
+  outside_ = 5.;
+  room_ = 18.;
+  radiator_ = sensor_c_ = valve_body_ = 25.;
+  valve_ = 0.25 * spread(random_);
+
+  heating_ = spread(random_) / 3000.;
+  cooling_ = spread(random_) / 1200.;
+  room_heating_ = spread(random_) / 7200.;
+  room_cooling_ = spread(random_) / 14400.;
+  stroke_ = spread(random_) * 0.01 / 200.;
+}
+
+void Plant::step(double seconds) {
+
+  while (seconds > 0.) {
+    double dt = seconds < 1. ? seconds : 1.;
+    // Flow through a valve rises steeply right after opening.
+    double flow = sqrt(valve_);
+    double water = radiator_ + (supply_ - radiator_) *
+                   (flow * 4. < 1. ? flow * 4. : 1.);
+
+    radiator_ += dt * (flow * heating_ * (supply_ - radiator_) +
+                       cooling_ * (room_ - radiator_));
+    room_ += dt * (room_heating_ * (radiator_ - room_) +
+                   room_cooling_ * (outside_ - room_));
+    sensor_c_ += dt / kSensorLag * (radiator_ - sensor_c_);
+    valve_body_ += dt / kValveLag * (water - valve_body_);
+
+    seconds -= dt;
+  }
+}
+
+void Plant::move(int ms) {
+
+  valve_ += ms * stroke_;
+  if (valve_ < 0.)
+    valve_ = 0.;
+  if (valve_ > 1.)
+    valve_ = 1.;
+}
+
+/**
+  Inverse of decicelsius() in protocol.h, plus noise.
+*/
+uint16_t Plant::readout(double celsius) {
+  double count = (71.445927 - celsius) / 0.00791 + noise_(random_);
+
+  if (count < 0.)
+    return 0;
+  if (count > 65535.)
+    return 65535;
+  return (uint16_t)lround(count);
+}
+
+} // namespace istatrol
@@ -0,0 +1,75 @@
+/** \file plant.h
+
+  A radiator, its valve and the room around it, as seen by the three
+  thermistors of an ISTAtrol. Drives the readings of istatrol-virtual.
+
+  Not meant to be accurate, just to behave like the real thing: slow, noisy
+  and with a lag between valve movements and what the sensors see. Time
+  constants are those of the Traumflug's radiator, give or take, every unit
+  gets its own random spread of them.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PLANT_H
+#define _PLANT_H
+
+#include <stdint.h>
+#include <random>
+
+
+namespace istatrol {
+
+class Plant {
+ public:
+  explicit Plant(uint32_t seed);
+
+  /// Let some time pass, in seconds. Steps of up to a second are fine.
+  void step(double seconds);
+
+  /**
+    Run the valve motor for the given time in milliseconds, positive opens,
+    negative closes. Same as MOT_OPEN_TIME and MOT_CLOSE_TIME in the
+    firmware.
+  */
+  void move(int ms);
+
+  /// Thermistor readouts like the firmware's ADC gets them, with noise.
+  uint16_t readout_c() { return readout(sensor_c_); }
+  uint16_t readout_v() { return readout(valve_body_); }
+  uint16_t readout_r() { return readout(room_); }
+
+ private:
+  uint16_t readout(double celsius);
+
+  // Temperatures in degrees Celsius.
+  double supply_, outside_;
+  double radiator_, valve_body_, room_, sensor_c_;
+  // Valve opening, 0.0 to 1.0.
+  double valve_;
+  // Rates per second, the inverse of time constants.
+  double heating_, cooling_, room_heating_, room_cooling_;
+  // Fraction of the full stroke per millisecond of motor run.
+  double stroke_;
+
+  std::mt19937 random_;
+  std::normal_distribution<double> noise_;
+};
+
+} // namespace istatrol
+
+#endif /* _PLANT_H */
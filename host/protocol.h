@@ -0,0 +1,476 @@
+/** \file protocol.h
+
+  What the ISTAtrol firmware speaks over USB. Keep this in sync with
+  usbFunctionSetup() in firmware/main.c.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <stdint.h>
+
+
+namespace istatrol {
+
+/// obdev's shared VID/PID pair, see firmware/usbconfig.h.
+constexpr uint16_t kVendorId = 0x16c0;
+constexpr uint16_t kProductId = 0x05e1;
+
+/**
+  bmRequestType for all our requests: vendor, device to host. Numbers below
+  0xA0 don't always make it to the device, see terminal.py.
+*/
+constexpr uint8_t kRequestTypeIn = 0xC0;
+
+/// Request for the regular reading, answered with struct answer.
+constexpr uint8_t kRequestReading = 'c';
+
+/**
+  Write one character of the serial number, wValue is the character,
+  wIndex its position. Firmware built with SERIAL_NUMBER only, else it's
+  answered like kRequestReading.
+*/
+constexpr uint8_t kRequestSerialNumber = 'S';
+
+/// Health counters, struct health. Firmware built with HEALTH only.
+constexpr uint8_t kRequestHealth = 'h';
+
+/**
+  Start the noise histogram, wValue is the lower end of bin 0 (0 picks one
+  around the first capture), wIndex the bin width as power of two.
+  kHistogramStop instead stops it. Firmware built with HISTOGRAM only.
+*/
+constexpr uint8_t kRequestHistogramStart = 'N';
+constexpr uint16_t kHistogramStop = 0xFF;
+
+/// The histogram, struct histogram. Firmware built with HISTOGRAM only.
+constexpr uint8_t kRequestHistogram = 'n';
+
+/**
+  Bandgap calibration, struct bandgap. With wValue not 0, the firmware
+  first calibrates for its current reading being wValue. Firmware built
+  with BANDGAP_REFERENCE and without REFERENCE_RESISTOR only.
+*/
+constexpr uint8_t kRequestBandgap = 'B';
+
+/// Button events, struct buttons. Firmware built with BUTTONS only.
+constexpr uint8_t kRequestButtons = 'e';
+
+/// Reset causes, struct watchdog. Firmware built with WATCHDOG only.
+constexpr uint8_t kRequestResets = 'r';
+
+/// Room control state, struct room. Firmware built with ROOM_CONTROL only.
+constexpr uint8_t kRequestRoom = 'u';
+
+/// Shadow regulation counts, struct shadow. Firmware built with SHADOW only.
+constexpr uint8_t kRequestShadow = 'x';
+
+/// Characters of the serial number stored in the device, SERIAL_NUMBER_LEN.
+constexpr unsigned kSerialNumberLength = 8;
+
+/**
+  The firmware measures about once per poll_a_second(), asking more often
+  just returns the same value again. A reading changes only with a control
+  decision, though, every RADIATOR_RESPONSE_TIME rounds, about two minutes,
+  and on a sensor fault. Until then it's sent again as is, see decisions.
+*/
+constexpr unsigned kMeasurementPeriodMs = 1000;
+
+/**
+  Largest reply we ever expect, room for the longest one, a histogram. See
+  the check after struct Histogram.
+*/
+constexpr unsigned kReplyMax = 32;
+
+/// Readout of a faulty sensor, TEMP_FAULT, and the largest real one, TEMP_MAX.
+constexpr uint16_t kTempFault = 0xFFFF;
+constexpr uint16_t kTempMax = 0xFFFE;
+
+/// Length of a reading, and of one from firmware built with MULTISENSOR_BROKEN.
+/// Firmware without the decision count sends one byte less.
+constexpr int kReadingLength = 4;
+constexpr int kReadingLengthMultisensor = 8;
+
+/**
+  One reading as sent by the firmware. Layout on the wire is little endian:
+
+    byte 0..1  temp_last, thermistor readout at the last control decision
+    byte 2     motor_moved, ' ', '+' or '-', '!' for a sensor fault
+
+  temp_last is kTempFault while the sensor is faulty, e.g. missing. The
+  firmware holds the valve then.
+
+  Firmware built with MULTISENSOR_BROKEN appends the other two sensors:
+
+    byte 3..4  temp_v, valve sensor readout
+    byte 5..6  temp_r, room sensor readout
+
+  The last byte counts control decisions, wrapping. Two readings with the
+  same count, temp_last and motor_moved are one decision, not two valve
+  moves.
+*/
+struct Reading {
+  uint16_t temp_c;
+  char motor_moved;
+  bool multisensor;
+  uint16_t temp_v;
+  uint16_t temp_r;
+  bool counted;             // Has the decision count.
+  uint8_t decisions;
+};
+
+/**
+  Decode a reply into a Reading. Returns false if the reply is too short to
+  be one. No allocation, so this is safe to call from transfer callbacks.
+*/
+inline bool decode(const uint8_t *data, int length, Reading &reading) {
+
+  if (length < kReadingLength - 1)
+    return false;
+
+  reading.temp_c = data[0] | (data[1] << 8);
+  reading.motor_moved = data[2];
+  reading.multisensor = length >= kReadingLengthMultisensor - 1;
+  if (reading.multisensor) {
+    reading.temp_v = data[3] | (data[4] << 8);
+    reading.temp_r = data[5] | (data[6] << 8);
+  } else {
+    reading.temp_v = reading.temp_r = 0;
+  }
+  reading.counted = length == kReadingLength ||
+                    length == kReadingLengthMultisensor;
+  reading.decisions = reading.counted ? data[length - 1] : 0;
+
+  return true;
+}
+
+/// Length of struct health in the firmware.
+constexpr int kHealthLength = 17;
+
+/**
+  Health counters, see struct health in firmware/main.c. Little endian on
+  the wire, in this order.
+*/
+struct Health {
+  uint16_t usb_resets;
+  uint16_t retriggers;
+  uint16_t timeouts;
+  uint16_t usbpoll_max_ms;
+  uint8_t osccal;
+  uint8_t osccal_min;
+  uint8_t osccal_max;
+  uint32_t uptime_s;
+  uint16_t enumerated_ms;
+};
+
+/**
+  Decode a health reply. Returns false if it isn't one, e.g. because the
+  firmware lacks HEALTH and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Health &health) {
+
+  if (length != kHealthLength)
+    return false;
+
+  health.usb_resets = data[0] | (data[1] << 8);
+  health.retriggers = data[2] | (data[3] << 8);
+  health.timeouts = data[4] | (data[5] << 8);
+  health.usbpoll_max_ms = data[6] | (data[7] << 8);
+  health.osccal = data[8];
+  health.osccal_min = data[9];
+  health.osccal_max = data[10];
+  health.uptime_s = data[11] | (data[12] << 8) | (data[13] << 16) |
+                    ((uint32_t)data[14] << 24);
+  health.enumerated_ms = data[15] | (data[16] << 8);
+
+  return true;
+}
+
+/// Length of struct bandgap in the firmware.
+constexpr int kBandgapLength = 4;
+
+/**
+  Bandgap calibration, readings get scaled by nominal / measured. 1 / 1
+  means not calibrated. Little endian on the wire, in this order.
+*/
+struct Bandgap {
+  uint16_t nominal;
+  uint16_t measured;
+};
+
+/**
+  Decode a bandgap reply. Returns false if it isn't one, e.g. because the
+  firmware lacks BANDGAP_REFERENCE and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Bandgap &bandgap) {
+
+  if (length != kBandgapLength)
+    return false;
+
+  bandgap.nominal = data[0] | (data[1] << 8);
+  bandgap.measured = data[2] | (data[3] << 8);
+
+  return true;
+}
+
+/// Length of struct watchdog in the firmware.
+constexpr int kResetsLength = 4;
+
+/**
+  Reset causes, see struct watchdog in firmware/main.c:
+
+    byte 0     cause, MCUSR at the last reset, see the bits below
+    byte 1     stalled, progress missing at the last watchdog reset
+    byte 2..3  watchdog resets since power-on
+*/
+struct Resets {
+  /// Bits of cause, as in MCUSR of the ATtiny2313.
+  static constexpr uint8_t power_on = 0x01;
+  static constexpr uint8_t external = 0x02;
+  static constexpr uint8_t brown_out = 0x04;
+  static constexpr uint8_t watchdog = 0x08;
+
+  /// Bits of stalled, WATCHDOG_USB, _MEASURE and _CONTROL.
+  static constexpr uint8_t usb = 0x01;
+  static constexpr uint8_t measure = 0x02;
+  static constexpr uint8_t control = 0x04;
+
+  uint8_t cause;
+  uint8_t stalled;
+  uint16_t watchdog_resets;
+};
+
+/**
+  Decode a reset causes reply. Returns false if it isn't one, e.g. because
+  the firmware lacks WATCHDOG and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Resets &resets) {
+
+  if (length != kResetsLength)
+    return false;
+
+  resets.cause = data[0];
+  resets.stalled = data[1];
+  resets.watchdog_resets = data[2] | (data[3] << 8);
+
+  return true;
+}
+
+/// Length of struct room in the firmware.
+constexpr int kRoomLength = 12;
+
+/**
+  Room control state, see struct room in firmware/main.c:
+
+    byte 0..1   target, the radiator (TEMP_C) readout regulation aims for
+    byte 2..3   temp_r, the room readout
+    byte 4..7   units, sum of TEMP_R - TEMP_C readouts where positive
+    byte 8..11  rounds, loop rounds summed up in units
+
+  units and rounds wrap, compare differences between two replies.
+*/
+struct Room {
+  uint16_t target;
+  uint16_t temp_r;
+  uint32_t units;
+  uint32_t rounds;
+};
+
+/**
+  Decode a room control reply. Returns false if it isn't one, e.g. because
+  the firmware lacks ROOM_CONTROL and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Room &room) {
+
+  if (length != kRoomLength)
+    return false;
+
+  room.target = data[0] | (data[1] << 8);
+  room.temp_r = data[2] | (data[3] << 8);
+  room.units = data[4] | (data[5] << 8) | ((uint32_t)data[6] << 16) |
+               ((uint32_t)data[7] << 24);
+  room.rounds = data[8] | (data[9] << 8) | ((uint32_t)data[10] << 16) |
+                ((uint32_t)data[11] << 24);
+
+  return true;
+}
+
+/// Length of struct shadow in the firmware.
+constexpr int kShadowLength = 12;
+
+/**
+  Decisions of the active and the candidate regulation, see struct shadow
+  in firmware/main.c:
+
+    byte 0..1   decisions taken by both
+    byte 2..3   decisions both took the same
+    byte 4..5   decisions one took opening, the other one closing
+    byte 6..7   decisions to move the valve by the active regulation
+    byte 8..9   decisions to move the valve by the candidate
+    byte 10     last decision of the active regulation
+    byte 11     last decision of the candidate
+
+  Decisions are '+' opening, '-' closing and ' ' holding the valve.
+  Counters wrap, compare differences between two replies.
+*/
+struct Shadow {
+  uint16_t decisions;
+  uint16_t agreed;
+  uint16_t opposed;
+  uint16_t active_moves;
+  uint16_t shadow_moves;
+  char active;
+  char shadow;
+};
+
+/**
+  Decode a shadow reply. Returns false if it isn't one, e.g. because the
+  firmware lacks SHADOW and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Shadow &shadow) {
+
+  if (length != kShadowLength)
+    return false;
+
+  shadow.decisions = data[0] | (data[1] << 8);
+  shadow.agreed = data[2] | (data[3] << 8);
+  shadow.opposed = data[4] | (data[5] << 8);
+  shadow.active_moves = data[6] | (data[7] << 8);
+  shadow.shadow_moves = data[8] | (data[9] << 8);
+  shadow.active = data[10];
+  shadow.shadow = data[11];
+
+  return true;
+}
+
+/// Events kept by the firmware, BUTTON_EVENTS, and length of struct buttons.
+constexpr int kButtonEvents = 4;
+constexpr int kButtonsLength = 4 + kButtonEvents;
+
+/**
+  Button state and recent events, see struct buttons in firmware/main.c:
+
+    byte 0     count, events since power-up, wrapping
+    byte 1     buttons down, bit 1 PLUS, bit 0 MINUS
+    byte 2..3  target, the thermistor readout regulation aims for
+    byte 4..   events, number count - 1 at (count - 1) % kButtonEvents
+
+  Events are '+' and '-' for a target step by PLUS and MINUS, 'o' and 'c'
+  for a valve opened or closed by holding PLUS or MINUS.
+*/
+struct Buttons {
+  static constexpr uint8_t plus = 0x02;
+  static constexpr uint8_t minus = 0x01;
+
+  uint8_t count;
+  uint8_t pressed;
+  uint16_t target;
+  char events[kButtonEvents];
+
+  /// Event number n, which must be one of the last kButtonEvents.
+  char event(uint8_t n) const { return events[n % kButtonEvents]; }
+};
+
+/**
+  Decode a buttons reply. Returns false if it isn't one, e.g. because the
+  firmware lacks BUTTONS and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Buttons &buttons) {
+
+  if (length != kButtonsLength)
+    return false;
+
+  buttons.count = data[0];
+  buttons.pressed = data[1];
+  buttons.target = data[2] | (data[3] << 8);
+  for (int i = 0; i < kButtonEvents; i++)
+    buttons.events[i] = data[4 + i];
+
+  return true;
+}
+
+/// Bins of struct histogram, HISTOGRAM_BINS, and length of it on the wire.
+constexpr int kHistogramBins = 16;
+constexpr int kHistogramLength = 6 + kHistogramBins;
+
+/**
+  Histogram of raw captures, see struct histogram in firmware/main.c:
+
+    byte 0     state, 0 off, 1 running, 2 full (a counter reached 255)
+    byte 1     shift, bins are 2^shift wide
+    byte 2..3  low, lower end of bin 0
+    byte 4     captures below bin 0
+    byte 5     captures above the last bin
+    byte 6..   bins
+*/
+struct Histogram {
+  enum State : uint8_t { off = 0, running = 1, full = 2 };
+
+  State state;
+  uint8_t shift;
+  uint16_t low;
+  uint8_t below;
+  uint8_t above;
+  uint8_t bins[kHistogramBins];
+};
+
+/**
+  Decode a histogram reply. Returns false if it isn't one, e.g. because the
+  firmware lacks HISTOGRAM and answered with a reading.
+*/
+inline bool decode(const uint8_t *data, int length, Histogram &histogram) {
+
+  if (length != kHistogramLength)
+    return false;
+
+  histogram.state = (Histogram::State)data[0];
+  histogram.shift = data[1];
+  histogram.low = data[2] | (data[3] << 8);
+  histogram.below = data[4];
+  histogram.above = data[5];
+  for (int i = 0; i < kHistogramBins; i++)
+    histogram.bins[i] = data[6 + i];
+
+  return true;
+}
+
+static_assert(kReadingLengthMultisensor <= kReplyMax &&
+              kHealthLength <= kReplyMax && kBandgapLength <= kReplyMax &&
+              kResetsLength <= kReplyMax && kRoomLength <= kReplyMax &&
+              kShadowLength <= kReplyMax && kButtonsLength <= kReplyMax &&
+              kHistogramLength <= kReplyMax,
+              "kReplyMax is too small for a reply");
+
+/**
+  Thermistor readout to degrees Celsius in tenths, using the linear
+  regression from Calibration measurements.gnumeric (see terminal.py):
+
+    f(x) = -0,00791 * x + 71,445927
+
+  Done in integers to keep formatting cheap.
+*/
+inline int32_t decicelsius(uint16_t temp_c) {
+  int32_t scaled = 7144593L - 791L * temp_c; // Degrees Celsius * 100000.
+
+  return (scaled >= 0 ? scaled + 5000 : scaled - 5000) / 10000;
+}
+
+} // namespace istatrol
+
+#endif /* _PROTOCOL_H */
@@ -0,0 +1,236 @@
+/** \file unit.cpp
+
+  One ISTAtrol controller attached to the host. See unit.h.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "unit.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "fleet.h"
+#include "naming.h"
+
+
+namespace istatrol {
+
+static uint64_t clock_ms(clockid_t clock) {
+  struct timespec now;
+
+  clock_gettime(clock, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_ms() {
+  return clock_ms(CLOCK_MONOTONIC);
+}
+
+uint64_t realtime_ms() {
+  return clock_ms(CLOCK_REALTIME);
+}
+
+bool Unit::open(libusb_device *device) {
+  struct libusb_device_descriptor descriptor;
+  char path[sizeof(id_)];
+  int result, configuration = 0;
+
+  bus_ = libusb_get_bus_number(device);
+  port_path(device, path, sizeof(path));
+  if ( ! sysfs_serial(path, id_, sizeof(id_)))
+    snprintf(id_, sizeof(id_), "%s", path);
+
+  result = libusb_get_device_descriptor(device, &descriptor);
+  if (result == LIBUSB_SUCCESS)
+    result = libusb_open(device, &handle_);
+  // The kernel usually configured the device already. Setting it again
+  // would cost a synchronous request, so don't.
+  if (result == LIBUSB_SUCCESS)
+    result = libusb_get_configuration(handle_, &configuration);
+  if (result == LIBUSB_SUCCESS && configuration == 0)
+    result = libusb_set_configuration(handle_, 1);
+  if (result == LIBUSB_SUCCESS) {
+    transfer_ = libusb_alloc_transfer(0);
+    if ( ! transfer_)
+      result = LIBUSB_ERROR_NO_MEM;
+  }
+  if (result != LIBUSB_SUCCESS) {
+    fprintf(stderr, "%s: can't open: %s\n", id_, libusb_strerror(result));
+    close();
+    return false;
+  }
+
+  device_ = libusb_ref_device(device);
+  failed_ = false;
+  have_last_ = false;
+  serial_index_ = descriptor.iSerialNumber;
+  state_ = State::identify;
+  // Already named by sysfs or nothing to ask for.
+  if (strcmp(id_, path) != 0 || ! serial_index_) {
+    state_ = State::ready;
+    fleet_.attached(*this);
+  }
+
+  return true;
+}
+
+void Unit::close() {
+
+  if (in_flight_) {
+    struct timeval tv = { 0, 100000 };
+
+    libusb_cancel_transfer(transfer_);
+    while (in_flight_)
+      libusb_handle_events_timeout_completed(fleet_.context(), &tv, nullptr);
+  }
+  if (transfer_) {
+    libusb_free_transfer(transfer_);
+    transfer_ = nullptr;
+  }
+  if (handle_) {
+    libusb_close(handle_);
+    handle_ = nullptr;
+  }
+  if (device_) {
+    libusb_unref_device(device_);
+    device_ = nullptr;
+  }
+}
+
+/**
+  Mark the unit as needing a re-open. The Fleet remembers when the first
+  failure happened, that's the moment the device is considered gone.
+*/
+void Unit::fail() {
+
+  if ( ! failed_)
+    fleet_.lost(*this);
+  failed_ = true;
+}
+
+bool Unit::submit() {
+  int result;
+
+  if ( ! handle_ || in_flight_ || failed_)
+    return false;
+
+  if (state_ == State::identify)
+    libusb_fill_control_setup(buffer_,
+      LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD,
+      LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_STRING << 8) | serial_index_,
+      0x0409, sizeof(buffer_) - LIBUSB_CONTROL_SETUP_SIZE);
+  else
+    libusb_fill_control_setup(buffer_, kRequestTypeIn, kRequestReading,
+                              0, 0, kReplyMax);
+  libusb_fill_control_transfer(transfer_, handle_, buffer_, transfer_done,
+                               this, kTransferTimeoutMs);
+
+  result = libusb_submit_transfer(transfer_);
+  if (result != LIBUSB_SUCCESS) {
+    fprintf(stderr, "%s: can't submit: %s\n", id_, libusb_strerror(result));
+    fail();
+    return false;
+  }
+  in_flight_ = true;
+
+  return true;
+}
+
+void LIBUSB_CALL Unit::transfer_done(libusb_transfer *transfer) {
+  static_cast<Unit *>(transfer->user_data)->complete(transfer);
+}
+
+void Unit::complete(libusb_transfer *transfer) {
+  const uint8_t *data = libusb_control_transfer_get_data(transfer);
+  Reading reading;
+
+  in_flight_ = false;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      if (state_ == State::identify)
+        identify(data, transfer->actual_length);
+      else if (decode(data, transfer->actual_length, reading) &&
+               ! repeated(reading))
+        output_.reading(id_, realtime_ms(), reading);
+      break;
+
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      // Device busy, e.g. moving the motor. Try again next time.
+      output_.note(id_, realtime_ms(), "timeout");
+      break;
+
+    case LIBUSB_TRANSFER_CANCELLED:
+      break;
+
+    case LIBUSB_TRANSFER_STALL:
+      if (state_ == State::identify) {
+        // No serial number after all, stay with the port path.
+        state_ = State::ready;
+        fleet_.attached(*this);
+        break;
+      }
+      // Fall through.
+    default:
+      // Can't close from within a transfer callback, the Fleet does that.
+      fail();
+      break;
+  }
+
+  // Last, because this may submit more transfers, including our next one.
+  fleet_.transfer_done(*this);
+}
+
+/**
+  Take the serial number from a string descriptor as the unit's name. It's
+  UTF-16, we keep what's printable ASCII.
+*/
+void Unit::identify(const uint8_t *data, int length) {
+  int i, n = 0;
+
+  if (length > data[0])
+    length = data[0];
+  for (i = 2; i + 1 < length && n < (int)kSerialMax; i += 2)
+    id_[n++] = data[i + 1] ? '_' : data[i];
+  if (n) {
+    id_[n] = '\0';
+    sanitize(id_);
+  }
+
+  state_ = State::ready;
+  fleet_.attached(*this);
+}
+
+/**
+  Whether this reading is the same decision as the previous one, sent
+  again because we asked before the next one was taken. Firmware without
+  the decision count can't tell, there every reading counts.
+*/
+bool Unit::repeated(const Reading &reading) {
+  bool same = have_last_ && reading.counted &&
+              reading.decisions == last_.decisions &&
+              reading.temp_c == last_.temp_c &&
+              reading.motor_moved == last_.motor_moved;
+
+  last_ = reading;
+  have_last_ = true;
+
+  return same;
+}
+
+} // namespace istatrol
@@ -0,0 +1,116 @@
+/** \file unit.h
+
+  One ISTAtrol controller attached to the host.
+
+  All I/O is asynchronous, a Unit never blocks the event loop. The transfer
+  and its buffer are allocated once when the unit is opened and reused for
+  every request. When a transfer gets submitted is up to the Fleet, which
+  keeps the number of transfers in flight per bus bounded.
+*/
+/*
+  Copyright (C) 2016 Markus "Traumflug" Hitter <mah@jump-ing.de>
+
+  This program is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation, either version 3 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _UNIT_H
+#define _UNIT_H
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#include "output.h"
+#include "protocol.h"
+
+
+namespace istatrol {
+
+class Fleet;
+
+/// Timeout for a single transfer. The firmware may not poll USB for a while
+/// when moving the motor, see motor_close().
+constexpr unsigned kTransferTimeoutMs = 2000;
+
+/// Longest serial number we care about, in characters.
+constexpr unsigned kSerialMax = 31;
+
+/// Monotonic milliseconds, for scheduling.
+uint64_t monotonic_ms();
+/// Milliseconds since the epoch, for timestamps.
+uint64_t realtime_ms();
+
+class Unit {
+ public:
+  Unit(Fleet &fleet, Output &output) : fleet_(fleet), output_(output) {}
+  ~Unit() { close(); }
+
+  Unit(const Unit &) = delete;
+  Unit &operator=(const Unit &) = delete;
+
+  /**
+    Open the given device. Returns false and logs why if that fails.
+
+    The unit is named by its serial number as found in sysfs. Where that
+    doesn't work, it's named by where it's plugged in until the serial
+    number is fetched from the device with the first request.
+  */
+  bool open(libusb_device *device);
+  void close();
+
+  bool is_open() const { return handle_ != nullptr; }
+  /// A transfer failed in a way that needs a re-open.
+  bool failed() const { return failed_; }
+  const char *id() const { return id_; }
+  libusb_device *device() const { return device_; }
+  uint8_t bus() const { return bus_; }
+
+  /// Whether this unit sits in its bus' queue, maintained by the Fleet.
+  bool queued = false;
+
+  /**
+    Submit the next request, a reading or the serial number. Returns true
+    if a transfer is now in flight; the Fleet gets told when it completes.
+  */
+  bool submit();
+
+ private:
+  enum class State { identify, ready };
+
+  static void LIBUSB_CALL transfer_done(libusb_transfer *transfer);
+  void complete(libusb_transfer *transfer);
+  void identify(const uint8_t *data, int length);
+  bool repeated(const Reading &reading);
+  void fail();
+
+  Fleet &fleet_;
+  Output &output_;
+  libusb_device *device_ = nullptr;
+  libusb_device_handle *handle_ = nullptr;
+  libusb_transfer *transfer_ = nullptr;
+  State state_ = State::identify;
+  uint8_t serial_index_ = 0;
+  uint8_t bus_ = 0;
+  bool in_flight_ = false;
+  bool failed_ = false;
+  bool have_last_ = false;
+  Reading last_;
+  uint8_t buffer_[LIBUSB_CONTROL_SETUP_SIZE + 2 + 2 * kSerialMax];
+  static_assert(2 + 2 * kSerialMax >= kReplyMax,
+                "buffer_ too small for a reading");
+  char id_[kSerialMax + 1] = "";
+};
+
+} // namespace istatrol
+
+#endif /* _UNIT_H */